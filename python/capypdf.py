@@ -17,6 +17,14 @@ class LineJoinStyle(Enum):
     Round = 1
     Bevel = 2
 
+class PathOperator(Enum):
+    Move = 0
+    Line = 1
+    Curve = 2
+    CurveV = 3
+    CurveY = 4
+    Close = 5
+
 class BlendMode(Enum):
     Normal = 0
     Multiply = 1
@@ -40,6 +48,12 @@ class DeviceColorspace(Enum):
     Gray = 1
     CMYK = 2
 
+colorspace_components = {
+    DeviceColorspace.RGB: 3,
+    DeviceColorspace.Gray: 1,
+    DeviceColorspace.CMYK: 4,
+}
+
 class ImageColorspace(Enum):
     RGB = 0
     Gray = 1
@@ -110,6 +124,25 @@ class Compression(Enum):
     Not = 0
     Deflate = 1
 
+class StreamClass(Enum):
+    Content = 0
+    Image = 1
+    Font = 2
+
+class Stat(Enum):
+    ObjectsWritten = 0
+    BytesWritten = 1
+    ContentBytesIn = 2
+    ContentBytesOut = 3
+    ImageBytesIn = 4
+    ImageBytesOut = 5
+    FontBytesIn = 6
+    FontBytesOut = 7
+    DeflateSeconds = 8
+    SubsetSeconds = 9
+    ImageDecodeSeconds = 10
+    WriteSeconds = 11
+
 class AnnotationFlag(IntFlag):
     Invisible = auto()
     Hidden = auto()
@@ -187,6 +220,10 @@ class CapyPDFException(Exception):
 
 ec_type = ctypes.c_int32
 enum_type = ctypes.c_int32
+sink_callback_type = ctypes.CFUNCTYPE(ctypes.c_int32,
+                                      ctypes.POINTER(ctypes.c_char),
+                                      ctypes.c_int64,
+                                      ctypes.c_void_p)
 
 class AnnotationId(ctypes.Structure):
     _fields_ = [('id', ctypes.c_int32)]
@@ -251,6 +288,13 @@ cfunc_types = (
 ('capy_options_set_pdfx', [ctypes.c_void_p, enum_type]),
 ('capy_options_set_default_page_properties', [ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_options_set_tagged', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_num_threads', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_coordinate_precision', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_streamed_writes', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_incremental_base', [ctypes.c_void_p, ctypes.c_char_p]),
+('capy_options_set_shard_object_offset', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_compression_level', [ctypes.c_void_p, enum_type, ctypes.c_int32]),
+('capy_options_set_object_streams', [ctypes.c_void_p, ctypes.c_int32]),
 
 ('capy_page_properties_new', [ctypes.c_void_p]),
 ('capy_page_properties_destroy', [ctypes.c_void_p]),
@@ -258,16 +302,20 @@ cfunc_types = (
     [ctypes.c_void_p, enum_type, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
 
 ('capy_generator_new', [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_void_p]),
+('capy_generator_clone', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
 ('capy_generator_add_page', [ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_form_xobject', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_color_pattern', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_embed_jpg', [ctypes.c_void_p, ctypes.c_char_p, enum_type, ctypes.c_void_p]),
+('capy_generator_embed_png', [ctypes.c_void_p, ctypes.c_char_p, enum_type, ctypes.c_void_p]),
 ('capy_generator_embed_file', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
 ('capy_generator_load_image', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
+('capy_generator_load_images', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_char_p), ctypes.c_int64, ctypes.POINTER(ctypes.c_void_p)]),
 ('capy_generator_convert_image', [ctypes.c_void_p, ctypes.c_void_p, enum_type, enum_type, ctypes.c_void_p]),
 ('capy_generator_load_icc_profile', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
 ('capy_generator_add_lab_colorspace', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_void_p]),
 ('capy_generator_load_font', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
+('capy_generator_load_cid_font', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
 ('capy_generator_add_image', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_type2_function', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_type2_shading', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
@@ -277,6 +325,10 @@ cfunc_types = (
 ('capy_generator_add_structure_item', [ctypes.c_void_p, enum_type, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_custom_structure_item', [ctypes.c_void_p, RoleId, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_write', [ctypes.c_void_p]),
+('capy_generator_write_async', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
+('capy_generator_wait', [ctypes.c_void_p]),
+('capy_generator_write_to_sink', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
+('capy_generator_get_stat', [ctypes.c_void_p, enum_type, ctypes.POINTER(ctypes.c_double)]),
 ('capy_generator_add_graphics_state', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_optional_content_group', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_outline', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
@@ -311,6 +363,8 @@ cfunc_types = (
 ('capy_dc_cmd_k', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_cmd_K', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_cmd_l', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double]),
+('capy_dc_draw_polyline', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_double), ctypes.c_int64]),
+('capy_dc_draw_path', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_double), ctypes.c_int64, ctypes.POINTER(ctypes.c_int32), ctypes.c_int64]),
 ('capy_dc_cmd_m', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_cmd_M', [ctypes.c_void_p, ctypes.c_double]),
 ('capy_dc_cmd_n', [ctypes.c_void_p]),
@@ -350,6 +404,11 @@ cfunc_types = (
 ('capy_text_sequence_append_actualtext_end', [ctypes.c_void_p]),
 ('capy_text_sequence_append_raw_glyph', [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint32]),
 ('capy_text_sequence_append_ligature_glyph', [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_char_p]),
+('capy_text_sequence_append_shaped_run', [ctypes.c_void_p,
+                                          ctypes.POINTER(ctypes.c_uint32),
+                                          ctypes.POINTER(ctypes.c_uint32),
+                                          ctypes.POINTER(ctypes.c_int32),
+                                          ctypes.c_int64]),
 ('capy_text_sequence_destroy', [ctypes.c_void_p]),
 
 ('capy_text_destroy', [ctypes.c_void_p]),
@@ -402,6 +461,7 @@ cfunc_types = (
 ('capy_raster_image_builder_new', [ctypes.c_void_p]),
 ('capy_raster_image_builder_set_size', [ctypes.c_void_p, ctypes.c_int32, ctypes.c_int32]),
 ('capy_raster_image_builder_set_pixel_data', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int32]),
+('capy_raster_image_builder_borrow_pixel_data', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int64, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_raster_image_builder_set_compression', [ctypes.c_void_p, enum_type]),
 ('capy_raster_image_builder_build', [ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_raster_image_get_colorspace', [ctypes.c_void_p, ctypes.POINTER(enum_type)]),
@@ -435,6 +495,10 @@ cfunc_types = (
                                ctypes.c_int32,
                                ctypes.POINTER(ctypes.c_double),
                                ctypes.c_void_p]),
+('capy_type4_shading_add_triangles', [ctypes.c_void_p,
+                                      ctypes.POINTER(ctypes.c_double),
+                                      ctypes.POINTER(ctypes.c_double),
+                                      ctypes.c_int64]),
 ('capy_type4_shading_destroy', [ctypes.c_void_p]),
 
 ('capy_type6_shading_new', [enum_type, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_void_p]),
@@ -445,6 +509,10 @@ cfunc_types = (
                                ctypes.c_int32,
                                ctypes.POINTER(ctypes.c_double),
                                ctypes.c_void_p]),
+('capy_type6_shading_add_patches', [ctypes.c_void_p,
+                                    ctypes.POINTER(ctypes.c_double),
+                                    ctypes.POINTER(ctypes.c_double),
+                                    ctypes.c_int64]),
 ('capy_type6_shading_destroy', [ctypes.c_void_p]),
 
 ('capy_text_annotation_new', [ctypes.c_char_p, ctypes.c_void_p]),
@@ -479,6 +547,8 @@ cfunc_types = (
 ('capy_outline_set_parent', [ctypes.c_void_p, OutlineId]),
 ('capy_outline_destroy', [ctypes.c_void_p]),
 
+('capy_merge_shards', [ctypes.POINTER(ctypes.c_char_p), ctypes.c_int32, ctypes.c_char_p]),
+
 )
 
 if sys.platform == 'win32':
@@ -489,6 +559,10 @@ else:
     libfile_name = 'libcapypdf.so'
 libfile = None
 
+# The library is loaded with ctypes.cdll rather than ctypes.PyDLL, so the
+# GIL is released for the duration of every C call. Long-running entry
+# points such as write(), load_image() and load_font() can thus run in
+# parallel from multiple Python threads.
 if 'CAPYPDF_SO_OVERRIDE' in os.environ:
     libfile = ctypes.cdll.LoadLibrary(os.path.join(os.environ['CAPYPDF_SO_OVERRIDE'], libfile_name))
 
@@ -545,6 +619,13 @@ def to_array(ctype, array):
         raise CapyPDFException('Array value argument must be an list or tuple.')
     return (ctype * len(array))(*array), len(array)
 
+def merge_shards(shard_files, ofilename):
+    if not isinstance(shard_files, (list, tuple)):
+        raise CapyPDFException('Shard file argument must be a list or tuple.')
+    files = [to_bytepath(f) for f in shard_files]
+    file_array = (ctypes.c_char_p * len(files))(*files)
+    check_error(libfile.capy_merge_shards(file_array, len(files), to_bytepath(ofilename)))
+
 class Options:
     def __init__(self):
         opt = ctypes.c_void_p()
@@ -599,6 +680,31 @@ class Options:
         tagint = 1 if is_tagged else 0
         check_error(libfile.capy_options_set_tagged(self, tagint))
 
+    def set_num_threads(self, num_threads):
+        check_error(libfile.capy_options_set_num_threads(self, num_threads))
+
+    def set_coordinate_precision(self, precision):
+        check_error(libfile.capy_options_set_coordinate_precision(self, precision))
+
+    def set_streamed_writes(self, use_streamed_writes):
+        streamint = 1 if use_streamed_writes else 0
+        check_error(libfile.capy_options_set_streamed_writes(self, streamint))
+
+    def set_object_streams(self, use_object_streams):
+        objstmint = 1 if use_object_streams else 0
+        check_error(libfile.capy_options_set_object_streams(self, objstmint))
+
+    def set_incremental_base(self, fname):
+        check_error(libfile.capy_options_set_incremental_base(self, to_bytepath(fname)))
+
+    def set_shard_object_offset(self, num_objects):
+        check_error(libfile.capy_options_set_shard_object_offset(self, num_objects))
+
+    def set_compression_level(self, stream_class, level):
+        if not isinstance(stream_class, StreamClass):
+            raise CapyPDFException('Argument must be a stream class.')
+        check_error(libfile.capy_options_set_compression_level(self, stream_class.value, level))
+
 
 class PageProperties:
     def __init__(self):
@@ -613,6 +719,39 @@ class PageProperties:
         check_error(libfile.capy_page_properties_set_pagebox(self, boxtype.value, x1, y1, x2, y2))
 
 
+class PathBuilder:
+    # Collects path operators on the Python side so that a whole path
+    # can be submitted to the library with a single FFI call instead of
+    # one call per operator.
+
+    def __init__(self):
+        self.coords = []
+        self.operators = []
+
+    def cmd_c(self, x1, y1, x2, y2, x3, y3):
+        self.coords += [x1, y1, x2, y2, x3, y3]
+        self.operators.append(PathOperator.Curve.value)
+
+    def cmd_h(self):
+        self.operators.append(PathOperator.Close.value)
+
+    def cmd_l(self, x, y):
+        self.coords += [x, y]
+        self.operators.append(PathOperator.Line.value)
+
+    def cmd_m(self, x, y):
+        self.coords += [x, y]
+        self.operators.append(PathOperator.Move.value)
+
+    def cmd_v(self, x2, y2, x3, y3):
+        self.coords += [x2, y2, x3, y3]
+        self.operators.append(PathOperator.CurveV.value)
+
+    def cmd_y(self, x1, y1, x3, y3):
+        self.coords += [x1, y1, x3, y3]
+        self.operators.append(PathOperator.CurveY.value)
+
+
 class DrawContextBase:
 
     def __init__(self, generator):
@@ -699,6 +838,23 @@ class DrawContextBase:
     def cmd_l(self, x, y):
         check_error(libfile.capy_dc_cmd_l(self, x, y))
 
+    def draw_polyline(self, points):
+        # A flat sequence of x/y pairs.
+        arr, num_coords = to_array(ctypes.c_double, points)
+        check_error(libfile.capy_dc_draw_polyline(self, arr, num_coords // 2))
+
+    def draw_path(self, coords, operators):
+        coordarr, num_coords = to_array(ctypes.c_double, coords)
+        oparr, num_ops = to_array(ctypes.c_int32, [op.value if isinstance(op, Enum) else op for op in operators])
+        check_error(libfile.capy_dc_draw_path(self, coordarr, num_coords, oparr, num_ops))
+
+    def draw_path_builder(self, pb):
+        if not isinstance(pb, PathBuilder):
+            raise CapyPDFException('Argument must be a PathBuilder.')
+        coordarr, num_coords = to_array(ctypes.c_double, pb.coords)
+        oparr, num_ops = to_array(ctypes.c_int32, pb.operators)
+        check_error(libfile.capy_dc_draw_path(self, coordarr, num_coords, oparr, num_ops))
+
     def cmd_m(self, x, y):
         check_error(libfile.capy_dc_cmd_m(self, x, y))
 
@@ -905,6 +1061,14 @@ class Generator:
         else:
             return False
 
+    def clone(self, filename):
+        file_name_bytes = to_bytepath(filename)
+        gptr = ctypes.c_void_p()
+        check_error(libfile.capy_generator_clone(self, file_name_bytes, ctypes.pointer(gptr)))
+        g = Generator.__new__(Generator)
+        g._as_parameter_ = gptr
+        return g
+
     def page_draw_context(self):
         return DrawContext(self)
 
@@ -931,6 +1095,13 @@ class Generator:
         check_error(libfile.capy_generator_embed_jpg(self, to_bytepath(fname), interpolate.value, ctypes.pointer(iid)))
         return iid
 
+    def embed_png(self, fname, interpolate=ImageInterpolation.Automatic):
+        if not isinstance(interpolate, ImageInterpolation):
+            raise CapyPDFException('Argument must be an image interpolation.')
+        iid = ImageId()
+        check_error(libfile.capy_generator_embed_png(self, to_bytepath(fname), interpolate.value, ctypes.pointer(iid)))
+        return iid
+
     def embed_file(self, fname):
         fid = EmbeddedFileId()
         check_error(libfile.capy_generator_embed_file(self, to_bytepath(fname), ctypes.pointer(fid)))
@@ -941,6 +1112,11 @@ class Generator:
         check_error(libfile.capy_generator_load_font(self, to_bytepath(fname), ctypes.pointer(fid)))
         return fid
 
+    def load_cid_font(self, fname):
+        fid = FontId()
+        check_error(libfile.capy_generator_load_cid_font(self, to_bytepath(fname), ctypes.pointer(fid)))
+        return fid
+
     def load_icc_profile(self, fname):
         iid = IccColorSpaceId()
         check_error(libfile.capy_generator_load_icc_profile(self, to_bytepath(fname), ctypes.pointer(iid)))
@@ -956,6 +1132,13 @@ class Generator:
         check_error(libfile.capy_generator_load_image(self, to_bytepath(fname), ctypes.pointer(optr)))
         return RasterImage(optr)
 
+    def load_images(self, fnames):
+        num_fnames = len(fnames)
+        name_array = (ctypes.c_char_p * num_fnames)(*[to_bytepath(f) for f in fnames])
+        optrs = (ctypes.c_void_p * num_fnames)()
+        check_error(libfile.capy_generator_load_images(self, name_array, num_fnames, optrs))
+        return [RasterImage(ctypes.c_void_p(optr)) for optr in optrs]
+
     def convert_image(self, in_image, output_cs, ri):
         if not isinstance(in_image, RasterImage):
             raise CapyPDFException('First argument must be a RasterImage object.')
@@ -1041,6 +1224,30 @@ class Generator:
     def write(self):
         check_error(libfile.capy_generator_write(self))
 
+    def write_async(self):
+        # The generator must not be touched until wait() has returned.
+        check_error(libfile.capy_generator_write_async(self, None, None))
+
+    def wait(self):
+        check_error(libfile.capy_generator_wait(self))
+
+    def get_stat(self, stat):
+        if not isinstance(stat, Stat):
+            raise CapyPDFException('Argument must be a Stat.')
+        value = ctypes.c_double()
+        check_error(libfile.capy_generator_get_stat(self, stat.value, ctypes.pointer(value)))
+        return value.value
+
+    def write_to_bytes(self):
+        # Returns the document as bytes without writing the output file.
+        chunks = []
+        def appender(buf, bufsize, ctx):
+            chunks.append(ctypes.string_at(buf, bufsize))
+            return 0
+        cb = sink_callback_type(appender)
+        check_error(libfile.capy_generator_write_to_sink(self, ctypes.cast(cb, ctypes.c_void_p), None))
+        return b''.join(chunks)
+
     def text_width(self, text, font, pointsize):
         if not isinstance(text, str):
             raise CapyPDFException('Text must be a Unicode string.')
@@ -1116,6 +1323,24 @@ class TextSequence:
         u8txt = txt.encode('UTF-8')
         check_error(libfile.capy_text_sequence_append_ligature_glyph(self, glyph_id, u8txt))
 
+    def append_shaped_run(self, glyph_ids, codepoints, kerns=None):
+        # Pre-shaped text, one entry per glyph. Kerns hold the TJ
+        # adjustment after each glyph, None means no adjustments.
+        if len(codepoints) != len(glyph_ids):
+            raise CapyPDFException('Codepoint array size does not match glyph array size.')
+        codepoints = [c if isinstance(c, int) else ord(c) for c in codepoints]
+        if kerns is None:
+            kernarr = None
+        else:
+            if len(kerns) != len(glyph_ids):
+                raise CapyPDFException('Kern array size does not match glyph array size.')
+            kernarr = to_array(ctypes.c_int32, kerns)[0]
+        check_error(libfile.capy_text_sequence_append_shaped_run(self,
+                    to_array(ctypes.c_uint32, glyph_ids)[0],
+                    to_array(ctypes.c_uint32, codepoints)[0],
+                    kernarr,
+                    len(glyph_ids)))
+
 
 class Text:
     def __init__(self, dc):
@@ -1305,6 +1530,15 @@ class RasterImageBuilder:
             raise CapyPDFException('Pixel data must be in bytes.')
         check_error(libfile.capy_raster_image_builder_set_pixel_data(self, pixels, len(pixels)))
 
+    def borrow_pixel_data(self, pixels):
+        if not isinstance(pixels, bytes):
+            raise CapyPDFException('Pixel data must be in bytes.')
+        # A reference to the buffer is held here and handed over to the
+        # built image so the bytes stay alive for as long as capypdf
+        # may read them.
+        self._borrowed_pixels = pixels
+        check_error(libfile.capy_raster_image_builder_borrow_pixel_data(self, pixels, len(pixels), None, None))
+
     def set_compression(self, compression):
         if not isinstance(compression, Compression):
             raise CapyPDFException('Compression argument must be enum value.')
@@ -1314,7 +1548,11 @@ class RasterImageBuilder:
     def build(self):
         opt = ctypes.c_void_p()
         check_error(libfile.capy_raster_image_builder_build(self, ctypes.pointer(opt)))
-        return RasterImage(opt)
+        image = RasterImage(opt)
+        if hasattr(self, '_borrowed_pixels'):
+            image._borrowed_pixels = self._borrowed_pixels
+            del self._borrowed_pixels
+        return image
 
 
 class GraphicsState:
@@ -1406,6 +1644,7 @@ class Type4Shading:
         check_error(libfile.capy_type4_shading_new(cs.value,
                     minx, miny, maxx, maxy, ctypes.pointer(t4s)))
         self._as_parameter_ = t4s
+        self.num_components = colorspace_components[cs]
 
     def __del__(self):
         check_error(libfile.capy_type4_shading_destroy(self))
@@ -1420,6 +1659,20 @@ class Type4Shading:
                     to_array(ctypes.c_double, coords)[0],
                     to_array(ctypes.c_void_p, colorptrs)[0]))
 
+    def add_triangles(self, coords, colors):
+        # Coords is a flat sequence of x/y pairs, three per triangle.
+        # Colors is a flat sequence of color components, three colors
+        # per triangle.
+        num_triangles = len(coords) // 6
+        if len(coords) != num_triangles * 6:
+            raise CapyPDFException('Coordinate array size must be a multiple of 6.')
+        if len(colors) != num_triangles * 3 * self.num_components:
+            raise CapyPDFException('Color array size does not match coordinate array size.')
+        check_error(libfile.capy_type4_shading_add_triangles(self,
+                    to_array(ctypes.c_double, coords)[0],
+                    to_array(ctypes.c_double, colors)[0],
+                    num_triangles))
+
     def extend(self, flag, coords, color):
         if flag == 1 or flag == 2:
             if not isinstance(color, Color):
@@ -1440,6 +1693,7 @@ class Type6Shading:
         check_error(libfile.capy_type6_shading_new(cs.value,
                     minx, miny, maxx, maxy, ctypes.pointer(t6s)))
         self._as_parameter_ = t6s
+        self.num_components = colorspace_components[cs]
 
     def __del__(self):
         check_error(libfile.capy_type6_shading_destroy(self))
@@ -1454,6 +1708,20 @@ class Type6Shading:
                     to_array(ctypes.c_double, coords)[0],
                     to_array(ctypes.c_void_p, colorptrs)[0]))
 
+    def add_patches(self, coords, colors):
+        # Coords is a flat sequence of x/y pairs, twelve per patch.
+        # Colors is a flat sequence of color components, four colors
+        # per patch.
+        num_patches = len(coords) // 24
+        if len(coords) != num_patches * 24:
+            raise CapyPDFException('Coordinate array size must be a multiple of 24.')
+        if len(colors) != num_patches * 4 * self.num_components:
+            raise CapyPDFException('Color array size does not match coordinate array size.')
+        check_error(libfile.capy_type6_shading_add_patches(self,
+                    to_array(ctypes.c_double, coords)[0],
+                    to_array(ctypes.c_double, colors)[0],
+                    num_patches))
+
     def extend(self, flag, coords, colors):
         if flag == 1 or flag == 2 or flag == 3:
             if len(coords) != 16:
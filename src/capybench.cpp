@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Jussi Pakkanen
+
+// Benchmarks for the hot paths of PDF generation. Run before and after
+// a change and compare the numbers, there is no pass/fail criterion.
+
+#include <pdfgen.hpp>
+#include <pdfdrawcontext.hpp>
+#include <fontsubsetter.hpp>
+#include <imagefileops.hpp>
+#include <utils.hpp>
+
+#include <chrono>
+#include <filesystem>
+#include <random>
+#include <cstdio>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#define CHCK(command)                                                                              \
+    {                                                                                              \
+        auto rc = command;                                                                         \
+        if(!rc) {                                                                                  \
+            fprintf(stderr, "%s\n", error_text(rc.error()));                                       \
+            std::abort();                                                                          \
+        }                                                                                          \
+    }
+
+using namespace capypdf;
+
+namespace {
+
+const char default_font[] = "/usr/share/fonts/truetype/noto/NotoSerif-Regular.ttf";
+const char default_image[] = "images/flame_gradient.png";
+
+template<typename Callable> double time_it(Callable &&cb) {
+    const auto t0 = std::chrono::steady_clock::now();
+    cb();
+    const auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+void report(const char *name, double seconds, double items, const char *unit, size_t bytes) {
+    printf("%-36s %10.1f ms", name, 1000.0 * seconds);
+    if(items > 0) {
+        printf(" %12.0f %s/s", items / seconds, unit);
+    }
+    if(bytes > 0) {
+        printf(" %10.1f MB/s", bytes / seconds / (1024.0 * 1024.0));
+    }
+    printf("\n");
+}
+
+// Text-like data that deflates well, unlike random bytes.
+std::string make_compressible_data(size_t size) {
+    const std::string_view words =
+        "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor ";
+    std::string data;
+    data.reserve(size + words.size());
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<size_t> dist(0, words.size() - 10);
+    while(data.size() < size) {
+        data += words.substr(dist(gen));
+    }
+    data.resize(size);
+    return data;
+}
+
+void bench_flate_compress() {
+    const auto data = make_compressible_data(8 * 1024 * 1024);
+    for(const int32_t level : {1, 9}) {
+        char name[64];
+        snprintf(name, sizeof(name), "flate_compress level %d", level);
+        const auto elapsed = time_it([&] { CHCK(flate_compress(data, 1, level)); });
+        report(name, elapsed, 0, "", data.size());
+    }
+}
+
+void bench_command_serialization() {
+    GenPopper genpop("capybench.pdf", PdfGenerationData{});
+    PdfGen &gen = *genpop.g;
+    std::unique_ptr<PdfDrawContext> ctx{gen.new_page_draw_context()};
+    const size_t num_ops = 1000000;
+    const auto elapsed = time_it([&] {
+        for(size_t i = 0; i < num_ops; ++i) {
+            CHCK(ctx->cmd_re(10 + (i % 100) * 0.25, 10, 100.5, 100.25));
+            CHCK(ctx->cmd_f());
+        }
+    });
+    report("draw command serialization", elapsed, 2.0 * num_ops, "cmd", 0);
+    CHCK(gen.add_page(*ctx));
+}
+
+void bench_glyph_subsetting() {
+    if(!std::filesystem::exists(default_font)) {
+        printf("%-36s skipped, %s not found\n", "glyph subsetting", default_font);
+        return;
+    }
+    FT_Library ft;
+    if(FT_Init_FreeType(&ft) != 0) {
+        return;
+    }
+    FT_Face face;
+    if(FT_New_Face(ft, default_font, 0, &face) != 0) {
+        return;
+    }
+    auto subsetter = FontSubsetter::construct(default_font, face, false);
+    if(!subsetter) {
+        fprintf(stderr, "%s\n", error_text(subsetter.error()));
+        std::abort();
+    }
+    size_t num_lookups = 0;
+    const auto elapsed = time_it([&] {
+        // Several rounds so most lookups hit the already-subsetted path.
+        for(int round = 0; round < 100; ++round) {
+            for(uint32_t codepoint = 32; codepoint < 0x180; ++codepoint) {
+                if(FT_Get_Char_Index(face, codepoint) == 0) {
+                    continue;
+                }
+                CHCK(subsetter->get_glyph_subset(codepoint, {}));
+                ++num_lookups;
+            }
+        }
+    });
+    report("glyph subset lookups", elapsed, num_lookups, "glyph", 0);
+    FT_Done_Face(face);
+    FT_Done_FreeType(ft);
+}
+
+void bench_image_loading() {
+    if(!std::filesystem::exists(default_image)) {
+        printf("%-36s skipped, %s not found (run from the source root)\n",
+               "load_image_file",
+               default_image);
+        return;
+    }
+    const auto num_bytes = std::filesystem::file_size(default_image);
+    const int rounds = 10;
+    const auto elapsed = time_it([&] {
+        for(int i = 0; i < rounds; ++i) {
+            CHCK(load_image_file(default_image));
+        }
+    });
+    report("load_image_file", elapsed, 0, "", rounds * num_bytes);
+}
+
+void bench_document_write(size_t num_pages) {
+    const char *ofname = "capybench.pdf";
+    size_t file_size = 0;
+    const auto elapsed = time_it([&] {
+        PdfGenerationData opts;
+        GenPopper genpop(ofname, opts);
+        PdfGen &gen = *genpop.g;
+        for(size_t p = 0; p < num_pages; ++p) {
+            auto ctxguard = gen.guarded_page_context();
+            auto &ctx = ctxguard.ctx;
+            CHCK(ctx.set_nonstroke_color(DeviceRGBColor{0.9, 0.2, 0.1}));
+            for(int i = 0; i < 20; ++i) {
+                CHCK(ctx.cmd_re(10 + 5 * i, 10 + 5 * i, 200, 100));
+                CHCK(ctx.cmd_f());
+            }
+        }
+    });
+    file_size = std::filesystem::file_size(ofname);
+    char name[64];
+    snprintf(name, sizeof(name), "generate and write %d pages", (int)num_pages);
+    report(name, elapsed, (double)num_pages, "page", file_size);
+}
+
+} // namespace
+
+int main() {
+    bench_flate_compress();
+    bench_command_serialization();
+    bench_glyph_subsetting();
+    bench_image_loading();
+    bench_document_write(1000);
+    bench_document_write(10000);
+    std::filesystem::remove("capybench.pdf");
+    return 0;
+}
@@ -74,6 +74,13 @@ const std::array<const char *, (std::size_t)ErrorCode::NumErrors> error_texts{
 "Image is not in format required by output settings.",
 "Page reference points to a non-existing page.",
 "Title is empty.",
+"An asynchronous write is already in progress.",
+"No asynchronous write in progress.",
+"Base file can not be used for an incremental update.",
+"The given options can not be used together.",
+"Write callback reported an error.",
+"Generator state can not be cloned.",
+"Shard files do not have disjoint object tables.",
 };
 
 // clang-format on
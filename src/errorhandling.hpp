@@ -72,6 +72,13 @@ enum class ErrorCode : int32_t {
     ImageFormatNotPermitted,
     InvalidPageNumber,
     EmptyTitle,
+    AsyncWritePending,
+    NoAsyncWrite,
+    IncrementalBaseUnsupported,
+    BadOptionCombination,
+    WriteCallbackFailed,
+    CloneUnsupported,
+    ShardMergeUnsupported,
     // When you add an error code here, also add the string representation in the .cpp file.
     NumErrors,
 };
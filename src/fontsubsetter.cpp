@@ -50,11 +50,12 @@ rvoe<std::vector<uint32_t>> get_all_subglyphs(uint32_t glyph_id, const TrueTypeF
 
 } // namespace
 
-rvoe<FontSubsetter> FontSubsetter::construct(const std::filesystem::path &fontfile, FT_Face face) {
-    ERC(ttfile, load_and_parse_truetype_font(fontfile));
+rvoe<FontSubsetter>
+FontSubsetter::construct(const std::filesystem::path &fontfile, FT_Face face, bool use_cid) {
+    ERC(ttfile, load_and_parse_truetype_font_cached(fontfile));
     std::vector<FontSubsetData> subsets;
     subsets.emplace_back(create_startstate());
-    return FontSubsetter(std::move(ttfile), face, std::move(subsets));
+    return FontSubsetter(std::move(ttfile), face, std::move(subsets), use_cid);
 }
 
 rvoe<FontSubsetInfo> FontSubsetter::get_glyph_subset(uint32_t codepoint,
@@ -79,14 +80,16 @@ rvoe<FontSubsetInfo> FontSubsetter::get_glyph_subset(const u8string &text,
 rvoe<FontSubsetInfo>
 FontSubsetter::unchecked_insert_glyph_to_last_subset(const uint32_t codepoint,
                                                      const std::optional<uint32_t> glyph_id) {
-    if(subsets.back().glyphs.size() == max_glyphs) {
+    if(subsets.back().glyphs.size() == glyph_limit()) {
         subsets.emplace_back(create_startstate());
     }
     const uint32_t glyph_index = glyph_id ? glyph_id.value() : FT_Get_Char_Index(face, codepoint);
     if(glyph_index == 0) {
         RETERR(MissingGlyph);
     }
-    if(codepoint == SPACE) {
+    // The location 32 rule below only applies to simple fonts. In a
+    // CID-keyed font the space character is a glyph like any other.
+    if(!use_cid && codepoint == SPACE) {
         // In the PDF document model the space character is special.
         // Every subset font _must_ have the space character in
         // location 32.
@@ -95,28 +98,34 @@ FontSubsetter::unchecked_insert_glyph_to_last_subset(const uint32_t codepoint,
             subsets.back().font_index_mapping[glyph_index] =
                 (uint32_t)subsets.back().glyphs.size() - 1;
         }
-        return FontSubsetInfo{int32_t(subsets.size() - 1), SPACE};
+        const FontSubsetInfo space_loc{int32_t(subsets.size() - 1), SPACE};
+        codepoint_index.emplace(SPACE, space_loc);
+        return space_loc;
     }
     ERCV(handle_subglyphs(glyph_index));
-    if(subsets.back().glyphs.size() == SPACE) {
+    if(!use_cid && subsets.back().glyphs.size() == SPACE) {
         // NOTE: the case where the subset font has fewer than 32 characters
         // is handled when serializing the font.
         subsets.back().glyphs.emplace_back(RegularGlyph{SPACE, FT_Get_Char_Index(face, SPACE)});
         subsets.back().font_index_mapping[glyph_index] = SPACE;
+        codepoint_index.emplace(SPACE, FontSubsetInfo{int32_t(subsets.size() - 1), SPACE});
     }
     subsets.back().glyphs.push_back(RegularGlyph{codepoint, glyph_index});
     subsets.back().font_index_mapping[glyph_index] = (uint32_t)subsets.back().glyphs.size() - 1;
-    return FontSubsetInfo{int32_t(subsets.size() - 1), int32_t(subsets.back().glyphs.size() - 1)};
+    const FontSubsetInfo loc{int32_t(subsets.size() - 1),
+                             int32_t(subsets.back().glyphs.size() - 1)};
+    codepoint_index.emplace(codepoint, loc);
+    return loc;
 }
 
 rvoe<NoReturnValue> FontSubsetter::handle_subglyphs(uint32_t glyph_index) {
-    if(glyph_index == 0 || glyph_index >= ttfile.glyphs.size()) {
+    if(glyph_index == 0 || glyph_index >= ttfile->glyphs.size()) {
         RETERR(MissingGlyph);
     }
-    ERC(iscomp, is_composite_glyph(ttfile.glyphs.at(glyph_index)));
+    ERC(iscomp, is_composite_glyph(ttfile->glyphs.at(glyph_index)));
     if(iscomp) {
-        ERC(subglyphs, get_all_subglyphs(glyph_index, ttfile));
-        if(subglyphs.size() + subsets.back().glyphs.size() >= max_glyphs) {
+        ERC(subglyphs, get_all_subglyphs(glyph_index, *ttfile));
+        if(subglyphs.size() + subsets.back().glyphs.size() >= glyph_limit()) {
             fprintf(stderr, "Composite glyph overflow not yet implemented.");
             std::abort();
         }
@@ -136,54 +145,37 @@ rvoe<NoReturnValue> FontSubsetter::handle_subglyphs(uint32_t glyph_index) {
 
 rvoe<FontSubsetInfo> FontSubsetter::unchecked_insert_glyph_to_last_subset(const u8string &text,
                                                                           uint32_t glyph_id) {
-    if(subsets.back().glyphs.size() == max_glyphs) {
+    if(subsets.back().glyphs.size() == glyph_limit()) {
         subsets.emplace_back(create_startstate());
     }
-    if(subsets.back().glyphs.size() == SPACE) {
+    if(!use_cid && subsets.back().glyphs.size() == SPACE) {
         // NOTE: the case where the subset font has fewer than 32 characters
         // is handled when serializing the font.
         subsets.back().glyphs.emplace_back(RegularGlyph{SPACE, FT_Get_Char_Index(face, SPACE)});
         subsets.back().font_index_mapping[glyph_id] = SPACE;
+        codepoint_index.emplace(SPACE, FontSubsetInfo{int32_t(subsets.size() - 1), SPACE});
     }
     ERCV(handle_subglyphs(glyph_id));
     subsets.back().glyphs.push_back(LigatureGlyph{text, glyph_id});
     subsets.back().font_index_mapping[glyph_id] = (uint32_t)subsets.back().glyphs.size() - 1;
-    return FontSubsetInfo{int32_t(subsets.size() - 1), int32_t(subsets.back().glyphs.size() - 1)};
+    const FontSubsetInfo loc{int32_t(subsets.size() - 1),
+                             int32_t(subsets.back().glyphs.size() - 1)};
+    ligature_index.emplace(std::string{text.sv()}, loc);
+    return loc;
 }
 
 std::optional<FontSubsetInfo> FontSubsetter::find_glyph(uint32_t glyph) const {
-    for(size_t subset = 0; subset < subsets.size(); ++subset) {
-        auto loc =
-            std::find_if(subsets.at(subset).glyphs.cbegin(),
-                         subsets.at(subset).glyphs.cend(),
-                         [&glyph](const TTGlyphs &ttg) {
-                             if(std::holds_alternative<RegularGlyph>(ttg)) {
-                                 return std::get<RegularGlyph>(ttg).unicode_codepoint == glyph;
-                             }
-                             return false;
-                         });
-        if(loc != subsets[subset].glyphs.cend()) {
-            return FontSubsetInfo{int32_t(subset),
-                                  int32_t(loc - subsets.at(subset).glyphs.cbegin())};
-        }
+    const auto loc = codepoint_index.find(glyph);
+    if(loc != codepoint_index.end()) {
+        return loc->second;
     }
     return {};
 }
 
 std::optional<FontSubsetInfo> FontSubsetter::find_glyph(const u8string &text) const {
-    for(size_t subset = 0; subset < subsets.size(); ++subset) {
-        auto loc = std::find_if(subsets.at(subset).glyphs.cbegin(),
-                                subsets.at(subset).glyphs.cend(),
-                                [&text](const TTGlyphs &ttg) {
-                                    if(std::holds_alternative<LigatureGlyph>(ttg)) {
-                                        return std::get<LigatureGlyph>(ttg).text == text;
-                                    }
-                                    return false;
-                                });
-        if(loc != subsets[subset].glyphs.cend()) {
-            return FontSubsetInfo{int32_t(subset),
-                                  int32_t(loc - subsets.at(subset).glyphs.cbegin())};
-        }
+    const auto loc = ligature_index.find(std::string{text.sv()});
+    if(loc != ligature_index.end()) {
+        return loc->second;
     }
     return {};
 }
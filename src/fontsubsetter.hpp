@@ -6,6 +6,7 @@
 #include <filesystem>
 #include <ft_subsetter.hpp>
 
+#include <memory>
 #include <vector>
 #include <string>
 #include <string_view>
@@ -19,6 +20,9 @@ typedef struct FT_FaceRec_ *FT_Face;
 namespace capypdf {
 
 static const std::size_t max_glyphs = 255;
+// CID-keyed subsets use two byte character codes, so one subset can
+// hold practically the entire font.
+static const std::size_t max_cid_glyphs = 65535;
 
 struct FontSubsetInfo {
     int32_t subset;
@@ -32,10 +36,14 @@ struct FontSubsetData {
 
 class FontSubsetter {
 public:
-    static rvoe<FontSubsetter> construct(const std::filesystem::path &fontfile, FT_Face face);
+    static rvoe<FontSubsetter>
+    construct(const std::filesystem::path &fontfile, FT_Face face, bool use_cid);
 
-    FontSubsetter(TrueTypeFontFile ttfile, FT_Face face, std::vector<FontSubsetData> subsets)
-        : ttfile{ttfile}, face{face}, subsets{subsets} {}
+    FontSubsetter(std::shared_ptr<const TrueTypeFontFile> ttfile,
+                  FT_Face face,
+                  std::vector<FontSubsetData> subsets,
+                  bool use_cid)
+        : ttfile{std::move(ttfile)}, face{face}, subsets{subsets}, use_cid{use_cid} {}
 
     rvoe<FontSubsetInfo> get_glyph_subset(uint32_t glyph, const std::optional<uint32_t> glyph_id);
     rvoe<FontSubsetInfo> get_glyph_subset(const u8string &text, const uint32_t glyph_id);
@@ -53,8 +61,16 @@ public:
         return subsets.at(subset_number).glyphs;
     }
 
+    // A copy of the subset state that does glyph lookups through the
+    // given face instead of the original one. Used when cloning a
+    // document, whose fonts are opened with its own FT_Library.
+    FontSubsetter clone_with_face(FT_Face new_face) const {
+        return FontSubsetter(ttfile, new_face, subsets, use_cid);
+    }
+
     size_t num_subsets() const { return subsets.size(); }
     size_t subset_size(size_t subset) const { return subsets.at(subset).glyphs.size(); }
+    bool is_cid() const { return use_cid; }
 
     rvoe<std::string>
     generate_subset(FT_Face face, const TrueTypeFontFile &source, int32_t subset_number) const;
@@ -62,12 +78,20 @@ public:
 private:
     rvoe<NoReturnValue> handle_subglyphs(uint32_t glyph_index);
 
-    TrueTypeFontFile ttfile;
+    std::size_t glyph_limit() const { return use_cid ? max_cid_glyphs : max_glyphs; }
+
+    // Shared with the process-wide font cache, immutable.
+    std::shared_ptr<const TrueTypeFontFile> ttfile;
     FT_Face face;
     std::optional<FontSubsetInfo> find_glyph(uint32_t glyph) const;
     std::optional<FontSubsetInfo> find_glyph(const u8string &text) const;
 
     std::vector<FontSubsetData> subsets;
+    bool use_cid = false;
+    // Incrementally maintained indexes so that per-character lookup does
+    // not have to scan every glyph of every subset.
+    std::unordered_map<uint32_t, FontSubsetInfo> codepoint_index;
+    std::unordered_map<std::string, FontSubsetInfo> ligature_index;
 };
 
 } // namespace capypdf
@@ -11,6 +11,8 @@
 #include <bit>
 #include <cmath>
 
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <variant>
 #include <expected>
@@ -918,8 +920,52 @@ rvoe<std::string> generate_font(FT_Face face,
 }
 
 rvoe<TrueTypeFontFile> load_and_parse_truetype_font(const std::filesystem::path &fname) {
-    ERC(buf, load_file(fname));
-    return parse_truetype_font(std::string_view{buf.data(), buf.size()});
+    // Parsing copies out the tables it needs, so the file bytes do not
+    // need to be duplicated on the heap first.
+    ERC(mapping, MappedFile::map(fname));
+    return parse_truetype_font(mapping.sv());
+}
+
+namespace {
+
+struct CachedFontEntry {
+    std::filesystem::file_time_type mtime;
+    uintmax_t fsize;
+    std::shared_ptr<const TrueTypeFontFile> parsed;
+};
+
+// Process-wide. Entries are never evicted, as a process typically uses
+// a handful of fonts over and over.
+std::mutex font_cache_mutex;
+std::unordered_map<std::string, CachedFontEntry> font_cache;
+
+} // namespace
+
+rvoe<std::shared_ptr<const TrueTypeFontFile>>
+load_and_parse_truetype_font_cached(const std::filesystem::path &fname) {
+    std::error_code ec;
+    const auto mtime = std::filesystem::last_write_time(fname, ec);
+    if(ec) {
+        RETERR(CouldNotOpenFile);
+    }
+    const auto fsize = std::filesystem::file_size(fname, ec);
+    if(ec) {
+        RETERR(CouldNotOpenFile);
+    }
+    auto key = fname.string();
+    {
+        std::lock_guard<std::mutex> lock(font_cache_mutex);
+        auto it = font_cache.find(key);
+        if(it != font_cache.end() && it->second.mtime == mtime && it->second.fsize == fsize) {
+            return it->second.parsed;
+        }
+    }
+    // Parse outside the lock so a slow font does not block other threads.
+    ERC(parsed, load_and_parse_truetype_font(fname));
+    auto shared = std::make_shared<const TrueTypeFontFile>(std::move(parsed));
+    std::lock_guard<std::mutex> lock(font_cache_mutex);
+    font_cache[std::move(key)] = CachedFontEntry{mtime, fsize, shared};
+    return shared;
 }
 
 rvoe<bool> is_composite_glyph(std::string_view buf) {
@@ -7,6 +7,7 @@
 #include <pdfcommon.hpp>
 #include <errorhandling.hpp>
 
+#include <memory>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -199,6 +200,12 @@ rvoe<std::string> generate_font(FT_Face face,
 
 rvoe<TrueTypeFontFile> parse_truetype_font(std::string_view buf);
 rvoe<TrueTypeFontFile> load_and_parse_truetype_font(const std::filesystem::path &fname);
+// As above, but answers from a process-wide cache so the same font
+// file is read and parsed only once no matter how many generators use
+// it. The returned object is immutable and shared, entries are
+// revalidated against the file's size and modification time.
+rvoe<std::shared_ptr<const TrueTypeFontFile>>
+load_and_parse_truetype_font_cached(const std::filesystem::path &fname);
 
 uint32_t font_id_for_glyph(FT_Face face, const capypdf::TTGlyphs &g);
 
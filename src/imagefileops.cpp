@@ -395,6 +395,80 @@ rvoe<jpg_image> load_jpg(const std::filesystem::path &fname) {
     return std::move(im);
 }
 
+rvoe<png_raw_image> load_png_for_passthrough(const std::filesystem::path &fname) {
+    ERC(contents, load_file(fname));
+    const std::string_view data{contents};
+    const std::string_view png_signature{"\x89PNG\r\n\x1a\n", 8};
+    if(data.size() < png_signature.size() || !data.starts_with(png_signature)) {
+        RETERR(UnsupportedFormat);
+    }
+    auto be32 = [&data](size_t offset) -> uint32_t {
+        const auto *b = (const unsigned char *)data.data() + offset;
+        return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    };
+    png_raw_image im;
+    bool have_ihdr = false;
+    size_t offset = png_signature.size();
+    // Chunk layout is size, type, payload and CRC.
+    while(offset + 12 <= data.size()) {
+        const size_t chunk_size = be32(offset);
+        const auto chunk_type = data.substr(offset + 4, 4);
+        const size_t payload = offset + 8;
+        if(payload + chunk_size + 4 > data.size()) {
+            RETERR(UnsupportedFormat);
+        }
+        if(chunk_type == "IHDR") {
+            if(chunk_size != 13) {
+                RETERR(UnsupportedFormat);
+            }
+            im.w = be32(payload);
+            im.h = be32(payload + 4);
+            im.bit_depth = (unsigned char)data[payload + 8];
+            const int32_t color_type = (unsigned char)data[payload + 9];
+            const int32_t interlace = (unsigned char)data[payload + 12];
+            // Interlaced data can not be copied through, the pixels
+            // are not in scanline order.
+            if(interlace != 0) {
+                RETERR(UnsupportedFormat);
+            }
+            switch(color_type) {
+            case PNG_COLOR_TYPE_GRAY:
+                im.num_channels = 1;
+                break;
+            case PNG_COLOR_TYPE_RGB:
+                im.num_channels = 3;
+                break;
+            case PNG_COLOR_TYPE_PALETTE:
+                im.num_channels = 1;
+                im.indexed = true;
+                break;
+            default:
+                // Alpha channels need to be split into an SMask.
+                RETERR(UnsupportedFormat);
+            }
+            have_ihdr = true;
+        } else if(chunk_type == "PLTE") {
+            im.palette = data.substr(payload, chunk_size);
+        } else if(chunk_type == "tRNS") {
+            // Transparency also needs an SMask.
+            RETERR(UnsupportedFormat);
+        } else if(chunk_type == "IDAT") {
+            im.idat += data.substr(payload, chunk_size);
+        } else if(chunk_type == "IEND") {
+            break;
+        }
+        offset = payload + chunk_size + 4;
+    }
+    if(!have_ihdr || im.idat.empty() || (im.indexed && im.palette.size() % 3 != 0) ||
+       (im.indexed && im.palette.empty())) {
+        RETERR(UnsupportedFormat);
+    }
+    if(im.w <= 0 || im.h <= 0) {
+        RETERR(InvalidImageSize);
+    }
+    return std::move(im);
+}
+
 rvoe<RasterImage> load_image_file(const std::filesystem::path &fname) {
     if(!std::filesystem::exists(fname)) {
         RETERR(FileDoesNotExist);
@@ -18,4 +18,10 @@ rvoe<RasterImage> load_image_file(const std::filesystem::path &fname);
 
 rvoe<jpg_image> load_jpg(const std::filesystem::path &fname);
 
+// Reads the chunks needed to embed a PNG without decoding its pixels.
+// Fails for images that need pixel level processing (alpha channels,
+// transparency, interlacing), the caller is expected to fall back to
+// the decoding path for those.
+rvoe<png_raw_image> load_png_for_passthrough(const std::filesystem::path &fname);
+
 } // namespace capypdf
@@ -2,6 +2,7 @@
 // Copyright 2023-2024 Jussi Pakkanen
 
 #include <capypdf.h>
+#include <cstdlib>
 #include <cstring>
 #include <pdfgen.hpp>
 #include <pdfdrawcontext.hpp>
@@ -170,6 +171,89 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_options_set_tagged(CapyPDF_Options *opt,
     RETNOERR;
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_options_set_num_threads(CapyPDF_Options *opt,
+                                                       int32_t num_threads) CAPYPDF_NOEXCEPT {
+    if(num_threads < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->num_threads = (uint32_t)num_threads;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_options_set_coordinate_precision(CapyPDF_Options *opt,
+                                                                int32_t precision)
+    CAPYPDF_NOEXCEPT {
+    if(precision < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    if(precision > 17) {
+        return (CapyPDF_EC)ErrorCode::IndexOutOfBounds;
+    }
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->coordinate_precision = precision;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_options_set_incremental_base(CapyPDF_Options *opt,
+                                                            const char *fname) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(fname);
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->incremental_base = fname;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_options_set_shard_object_offset(CapyPDF_Options *opt,
+                                                               int32_t num_objects)
+    CAPYPDF_NOEXCEPT {
+    if(num_objects < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->shard_object_offset = num_objects;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_options_set_streamed_writes(CapyPDF_Options *opt,
+                                                           int32_t use_streamed_writes)
+    CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->streamed_writes = use_streamed_writes != 0;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_options_set_compression_level(CapyPDF_Options *opt,
+                                                             CapyPDF_Stream_Class stream_class,
+                                                             int32_t level) CAPYPDF_NOEXCEPT {
+    if((int)stream_class < 0 || stream_class > CAPY_STREAM_CLASS_FONT) {
+        return (CapyPDF_EC)ErrorCode::BadEnum;
+    }
+    if(level < 1 || level > 9) {
+        return (CapyPDF_EC)ErrorCode::IndexOutOfBounds;
+    }
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    switch(stream_class) {
+    case CAPY_STREAM_CLASS_IMAGE:
+        opts->compression.image_level = level;
+        break;
+    case CAPY_STREAM_CLASS_FONT:
+        opts->compression.font_level = level;
+        break;
+    default:
+        opts->compression.content_level = level;
+        break;
+    }
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_options_set_object_streams(CapyPDF_Options *opt,
+                                                          int32_t use_object_streams)
+    CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->use_object_streams = use_object_streams != 0;
+    RETNOERR;
+}
+
 CapyPDF_EC capy_generator_new(const char *filename,
                               const CapyPDF_Options *options,
                               CapyPDF_Generator **out_ptr) CAPYPDF_NOEXCEPT {
@@ -184,6 +268,20 @@ CapyPDF_EC capy_generator_new(const char *filename,
     return conv_err(rc);
 }
 
+CapyPDF_EC capy_generator_clone(const CapyPDF_Generator *gen,
+                                const char *filename,
+                                CapyPDF_Generator **out_ptr) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(gen);
+    CHECK_NULL(filename);
+    CHECK_NULL(out_ptr);
+    auto *g = reinterpret_cast<const PdfGen *>(gen);
+    auto rc = g->clone(filename);
+    if(rc) {
+        *out_ptr = reinterpret_cast<CapyPDF_Generator *>(rc.value().release());
+    }
+    return conv_err(rc);
+}
+
 CapyPDF_EC capy_generator_add_page(CapyPDF_Generator *gen,
                                    CapyPDF_DrawContext *ctx) CAPYPDF_NOEXCEPT {
     auto *g = reinterpret_cast<PdfGen *>(gen);
@@ -230,6 +328,18 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_generator_embed_jpg(CapyPDF_Generator *gen,
     return conv_err(rc);
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_embed_png(CapyPDF_Generator *gen,
+                                                   const char *fname,
+                                                   CapyPDF_Image_Interpolation interpolate,
+                                                   CapyPDF_ImageId *out_ptr) CAPYPDF_NOEXCEPT {
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    auto rc = g->embed_png(fname, interpolate);
+    if(rc) {
+        *out_ptr = rc.value();
+    }
+    return conv_err(rc);
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_generator_embed_file(
     CapyPDF_Generator *gen, const char *fname, CapyPDF_EmbeddedFileId *out_ptr) CAPYPDF_NOEXCEPT {
     auto *g = reinterpret_cast<PdfGen *>(gen);
@@ -251,6 +361,17 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_generator_load_font(CapyPDF_Generator *gen,
     return conv_err(rc);
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_load_cid_font(CapyPDF_Generator *gen,
+                                                       const char *fname,
+                                                       CapyPDF_FontId *out_ptr) CAPYPDF_NOEXCEPT {
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    auto rc = g->load_cid_font(fname);
+    if(rc) {
+        *out_ptr = rc.value();
+    }
+    return conv_err(rc);
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_generator_load_image(
     CapyPDF_Generator *gen, const char *fname, CapyPDF_RasterImage **out_ptr) CAPYPDF_NOEXCEPT {
     auto *g = reinterpret_cast<PdfGen *>(gen);
@@ -261,6 +382,34 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_generator_load_image(
     return conv_err(rc);
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_load_images(CapyPDF_Generator *gen,
+                                                     const char **fnames,
+                                                     int64_t num_fnames,
+                                                     CapyPDF_RasterImage **out_ptr)
+    CAPYPDF_NOEXCEPT {
+    CHECK_NULL(gen);
+    CHECK_NULL(fnames);
+    CHECK_NULL(out_ptr);
+    if(num_fnames < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    std::vector<std::filesystem::path> paths;
+    paths.reserve(num_fnames);
+    for(int64_t i = 0; i < num_fnames; ++i) {
+        CHECK_NULL(fnames[i]);
+        paths.emplace_back(fnames[i]);
+    }
+    auto rc = g->load_images(paths);
+    if(rc) {
+        for(int64_t i = 0; i < num_fnames; ++i) {
+            out_ptr[i] =
+                reinterpret_cast<CapyPDF_RasterImage *>(new RasterImage(std::move(rc.value()[i])));
+        }
+    }
+    return conv_err(rc);
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_generator_convert_image(CapyPDF_Generator *gen,
                                                        const CapyPDF_RasterImage *source,
                                                        CapyPDF_DeviceColorspace output_cs,
@@ -477,6 +626,48 @@ CapyPDF_EC capy_generator_write(CapyPDF_Generator *gen) CAPYPDF_NOEXCEPT {
     return conv_err(rc);
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_write_async(CapyPDF_Generator *gen,
+                                                     CapyPDF_Write_Completion_Callback cb,
+                                                     void *user_data) CAPYPDF_NOEXCEPT {
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    auto rc = g->start_async_write(cb, user_data);
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_write_to_sink(CapyPDF_Generator *gen,
+                                                       CapyPDF_Write_Sink_Callback cb,
+                                                       void *ctx) CAPYPDF_NOEXCEPT {
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    auto rc = g->write_to_sink(cb, ctx);
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_get_stat(CapyPDF_Generator *gen,
+                                                  CapyPDF_Stat stat,
+                                                  double *out_ptr) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(out_ptr);
+    if((int)stat < 0 || stat > CAPY_STAT_WRITE_SECONDS) {
+        return (CapyPDF_EC)ErrorCode::BadEnum;
+    }
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    *out_ptr = g->get_stat(stat);
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_set_trace_callback(CapyPDF_Generator *gen,
+                                                            CapyPDF_Trace_Callback cb,
+                                                            void *ctx) CAPYPDF_NOEXCEPT {
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    g->set_trace_callback(cb, ctx);
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_wait(CapyPDF_Generator *gen) CAPYPDF_NOEXCEPT {
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    auto rc = g->wait_for_write();
+    return conv_err(rc);
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_generator_add_optional_content_group(
     CapyPDF_Generator *gen,
     const CapyPDF_OptionalContentGroup *ocg,
@@ -702,6 +893,31 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_dc_cmd_l(CapyPDF_DrawContext *ctx,
     return conv_err(dc->cmd_l(x, y));
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_dc_draw_polyline(CapyPDF_DrawContext *ctx,
+                                                const double *points,
+                                                int64_t num_points) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(points);
+    if(num_points < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    auto dc = reinterpret_cast<PdfDrawContext *>(ctx);
+    return conv_err(dc->draw_polyline(points, (size_t)num_points));
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_dc_draw_path(CapyPDF_DrawContext *ctx,
+                                            const double *coords,
+                                            int64_t num_coords,
+                                            const CapyPDF_Path_Operator *ops,
+                                            int64_t num_ops) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(coords);
+    CHECK_NULL(ops);
+    if(num_coords < 0 || num_ops < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    auto dc = reinterpret_cast<PdfDrawContext *>(ctx);
+    return conv_err(dc->draw_path(coords, (size_t)num_coords, ops, (size_t)num_ops));
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_dc_cmd_m(CapyPDF_DrawContext *ctx,
                                         double x,
                                         double y) CAPYPDF_NOEXCEPT {
@@ -969,6 +1185,35 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_text_sequence_append_ligature_glyph(
     return conv_err(rc);
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_text_sequence_append_shaped_run(CapyPDF_TextSequence *tseq,
+                                                               const uint32_t *glyph_ids,
+                                                               const uint32_t *codepoints,
+                                                               const int32_t *kerns,
+                                                               int64_t num_glyphs)
+    CAPYPDF_NOEXCEPT {
+    CHECK_NULL(glyph_ids);
+    CHECK_NULL(codepoints);
+    if(num_glyphs < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    auto *ts = reinterpret_cast<TextSequence *>(tseq);
+    GlyphRun run;
+    run.glyph_ids.assign(glyph_ids, glyph_ids + num_glyphs);
+    run.codepoints.assign(codepoints, codepoints + num_glyphs);
+    if(kerns) {
+        run.kerns.assign(kerns, kerns + num_glyphs);
+    } else {
+        run.kerns.assign((size_t)num_glyphs, 0);
+    }
+    for(const auto &g : run.glyph_ids) {
+        if(g == 0) {
+            return conv_err(ErrorCode::MissingGlyph);
+        }
+    }
+    auto rc = ts->append_shaped_run(std::move(run));
+    return conv_err(rc);
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_text_sequence_destroy(CapyPDF_TextSequence *tseq) CAPYPDF_NOEXCEPT {
     delete reinterpret_cast<TextSequence *>(tseq);
     RETNOERR;
@@ -1314,6 +1559,22 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_raster_image_builder_set_pixel_data(
     RETNOERR;
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC
+capy_raster_image_builder_borrow_pixel_data(CapyPDF_RasterImageBuilder *builder,
+                                            const char *buf,
+                                            int64_t bufsize,
+                                            CapyPDF_Buffer_Release_Callback release_cb,
+                                            void *user_data) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(builder);
+    CHECK_NULL(buf);
+    if(bufsize < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    auto *b = reinterpret_cast<RasterImageBuilder *>(builder);
+    b->i->borrowed_pixels = BorrowedBytes{buf, (size_t)bufsize, release_cb, user_data};
+    RETNOERR;
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_raster_image_builder_set_compression(
     CapyPDF_RasterImageBuilder *builder, CapyPDF_Compression compression) CAPYPDF_NOEXCEPT {
     auto *b = reinterpret_cast<RasterImageBuilder *>(builder);
@@ -1480,6 +1741,56 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_type4_shading_extend(CapyPDF_Type4Shading *shade,
     RETNOERR;
 }
 
+static int32_t num_color_components(CapyPDF_DeviceColorspace cs) {
+    switch(cs) {
+    case CAPY_DEVICE_CS_RGB:
+        return 3;
+    case CAPY_DEVICE_CS_GRAY:
+        return 1;
+    case CAPY_DEVICE_CS_CMYK:
+        return 4;
+    }
+    std::abort();
+}
+
+static Color conv_packed_color(CapyPDF_DeviceColorspace cs, const double *comps) {
+    switch(cs) {
+    case CAPY_DEVICE_CS_RGB:
+        return DeviceRGBColor{comps[0], comps[1], comps[2]};
+    case CAPY_DEVICE_CS_GRAY:
+        return DeviceGrayColor{comps[0]};
+    case CAPY_DEVICE_CS_CMYK:
+        return DeviceCMYKColor{comps[0], comps[1], comps[2], comps[3]};
+    }
+    std::abort();
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_type4_shading_add_triangles(CapyPDF_Type4Shading *shade,
+                                                           const double *coords,
+                                                           const double *colors,
+                                                           int64_t num_triangles) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(coords);
+    CHECK_NULL(colors);
+    if(num_triangles < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    auto *sh = reinterpret_cast<ShadingType4 *>(shade);
+    const auto ncomp = num_color_components(sh->colorspace);
+    sh->elements.reserve(sh->elements.size() + 3 * (size_t)num_triangles);
+    for(int64_t t = 0; t < num_triangles; ++t) {
+        for(int v = 0; v < 3; ++v) {
+            ShadingPoint sp;
+            sp.p.x = coords[0];
+            sp.p.y = coords[1];
+            coords += 2;
+            sp.c = conv_packed_color(sh->colorspace, colors);
+            colors += ncomp;
+            sh->elements.emplace_back(ShadingElement{sp, 0});
+        }
+    }
+    RETNOERR;
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_type4_shading_destroy(CapyPDF_Type4Shading *shade) CAPYPDF_NOEXCEPT {
     delete reinterpret_cast<ShadingType4 *>(shade);
     RETNOERR;
@@ -1543,6 +1854,34 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_type6_shading_extend(CapyPDF_Type6Shading *shade,
     RETNOERR;
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_type6_shading_add_patches(CapyPDF_Type6Shading *shade,
+                                                         const double *coords,
+                                                         const double *colors,
+                                                         int64_t num_patches) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(coords);
+    CHECK_NULL(colors);
+    if(num_patches < 0) {
+        return (CapyPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    auto *sh = reinterpret_cast<ShadingType6 *>(shade);
+    const auto ncomp = num_color_components(sh->colorspace);
+    sh->elements.reserve(sh->elements.size() + (size_t)num_patches);
+    for(int64_t t = 0; t < num_patches; ++t) {
+        FullCoonsPatch cp;
+        for(int i = 0; i < (int)cp.p.size(); ++i) {
+            cp.p[i].x = coords[2 * i];
+            cp.p[i].y = coords[2 * i + 1];
+        }
+        coords += 2 * cp.p.size();
+        for(int i = 0; i < (int)cp.c.size(); ++i) {
+            cp.c[i] = conv_packed_color(sh->colorspace, colors);
+            colors += ncomp;
+        }
+        sh->elements.emplace_back(std::move(cp));
+    }
+    RETNOERR;
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_type6_shading_destroy(CapyPDF_Type6Shading *shade) CAPYPDF_NOEXCEPT {
     delete reinterpret_cast<ShadingType6 *>(shade);
     RETNOERR;
@@ -1774,6 +2113,26 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_outline_destroy(CapyPDF_Outline *outline) CAPYPDF
     RETNOERR;
 }
 
+// Sharding.
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_merge_shards(const char **shard_files,
+                                            int32_t num_shards,
+                                            const char *ofilename) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(shard_files);
+    CHECK_NULL(ofilename);
+    if(num_shards <= 0) {
+        return (CapyPDF_EC)ErrorCode::ShardMergeUnsupported;
+    }
+    std::vector<std::filesystem::path> files;
+    files.reserve(num_shards);
+    for(int32_t i = 0; i < num_shards; ++i) {
+        CHECK_NULL(shard_files[i]);
+        files.emplace_back(shard_files[i]);
+    }
+    auto rc = merge_shards(files, ofilename);
+    return conv_err(rc);
+}
+
 // Error handling.
 
 const char *capy_error_message(CapyPDF_EC error_code) CAPYPDF_NOEXCEPT {
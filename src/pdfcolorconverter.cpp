@@ -9,6 +9,8 @@
 #include <cassert>
 #include <stdexcept>
 #include <array>
+#include <thread>
+#include <vector>
 
 namespace {
 
@@ -17,6 +19,9 @@ const std::array<int, 4> ri2lcms = {INTENT_RELATIVE_COLORIMETRIC,
                                     INTENT_SATURATION,
                                     INTENT_PERCEPTUAL};
 
+// Splitting tiny images across threads costs more than it saves.
+const uint32_t MIN_PIXELS_PER_THREAD = 64 * 1024;
+
 int32_t num_bytes_for(CapyPDF_DeviceColorspace cs) {
     switch(cs) {
     case CAPY_DEVICE_CS_RGB:
@@ -29,7 +34,6 @@ int32_t num_bytes_for(CapyPDF_DeviceColorspace cs) {
     std::abort();
 }
 
-/*
 int32_t num_bytes_for(CapyPDF_ImageColorspace cs) {
     switch(cs) {
     case CAPY_IMAGE_CS_RGB:
@@ -41,7 +45,6 @@ int32_t num_bytes_for(CapyPDF_ImageColorspace cs) {
     }
     std::abort();
 }
-*/
 
 uint32_t pixelformat_for(CapyPDF_DeviceColorspace cs) {
     switch(cs) {
@@ -146,44 +149,59 @@ PdfColorConverter::construct(const std::filesystem::path &rgb_profile_fname,
 
 PdfColorConverter::PdfColorConverter() {}
 
-PdfColorConverter::~PdfColorConverter() {}
+PdfColorConverter::~PdfColorConverter() {
+    for(const auto &[key, transform] : transform_cache) {
+        cmsDeleteTransform(transform);
+    }
+}
+
+cmsHTRANSFORM PdfColorConverter::get_transform(cmsHPROFILE input,
+                                               uint32_t input_format,
+                                               cmsHPROFILE output,
+                                               uint32_t output_format,
+                                               int lcms_intent) const {
+    const TransformKey key{input, input_format, output, output_format, lcms_intent};
+    auto existing = transform_cache.find(key);
+    if(existing != transform_cache.end()) {
+        return existing->second;
+    }
+    // NOCACHE so the same transform can be used from multiple threads.
+    auto transform = cmsCreateTransform(
+        input, input_format, output, output_format, lcms_intent, cmsFLAGS_NOCACHE);
+    transform_cache[key] = transform;
+    return transform;
+}
 
 DeviceRGBColor PdfColorConverter::to_rgb(const DeviceCMYKColor &cmyk) {
     DeviceRGBColor rgb;
-    auto transform = cmsCreateTransform(cmyk_profile.h,
-                                        TYPE_CMYK_DBL,
-                                        gray_profile.h,
-                                        TYPE_RGB_DBL,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = get_transform(cmyk_profile.h,
+                                   TYPE_CMYK_DBL,
+                                   rgb_profile.h,
+                                   TYPE_RGB_DBL,
+                                   ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC));
     cmsDoTransform(transform, &cmyk, &rgb, 1);
-    cmsDeleteTransform(transform);
     return rgb;
 }
 
 DeviceGrayColor PdfColorConverter::to_gray(const DeviceRGBColor &rgb) {
     DeviceGrayColor gray;
-    auto transform = cmsCreateTransform(rgb_profile.h,
-                                        TYPE_RGB_DBL,
-                                        gray_profile.h,
-                                        TYPE_GRAY_DBL,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = get_transform(rgb_profile.h,
+                                   TYPE_RGB_DBL,
+                                   gray_profile.h,
+                                   TYPE_GRAY_DBL,
+                                   ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC));
     cmsDoTransform(transform, &rgb, &gray, 1);
-    cmsDeleteTransform(transform);
     return gray;
 }
 
 DeviceGrayColor PdfColorConverter::to_gray(const DeviceCMYKColor &cmyk) {
     DeviceGrayColor gray;
-    auto transform = cmsCreateTransform(cmyk_profile.h,
-                                        TYPE_CMYK_DBL,
-                                        gray_profile.h,
-                                        TYPE_GRAY_DBL,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = get_transform(cmyk_profile.h,
+                                   TYPE_CMYK_DBL,
+                                   gray_profile.h,
+                                   TYPE_GRAY_DBL,
+                                   ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC));
     cmsDoTransform(transform, &cmyk, &gray, 1);
-    cmsDeleteTransform(transform);
     return gray;
 }
 
@@ -193,18 +211,16 @@ rvoe<DeviceCMYKColor> PdfColorConverter::to_cmyk(const DeviceRGBColor &rgb) {
     }
     DeviceCMYKColor cmyk;
     double buf[4]; // PDF uses values [0, 1] but littlecms seems to use [0, 100].
-    auto transform = cmsCreateTransform(rgb_profile.h,
-                                        TYPE_RGB_DBL,
-                                        cmyk_profile.h,
-                                        TYPE_CMYK_DBL,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = get_transform(rgb_profile.h,
+                                   TYPE_RGB_DBL,
+                                   cmyk_profile.h,
+                                   TYPE_CMYK_DBL,
+                                   ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC));
     cmsDoTransform(transform, &rgb, &buf, 1);
     cmyk.c = buf[0] / 100.0;
     cmyk.m = buf[1] / 100.0;
     cmyk.y = buf[2] / 100.0;
     cmyk.k = buf[3] / 100.0;
-    cmsDeleteTransform(transform);
     return cmyk;
 }
 
@@ -227,17 +243,19 @@ cmsHPROFILE PdfColorConverter::profile_for(CapyPDF_ImageColorspace cs) const {
     std::abort();
 }
 
-rvoe<RasterImage> PdfColorConverter::convert_image_to(RasterImage ri,
+rvoe<RasterImage> PdfColorConverter::convert_image_to(const RasterImage &ri,
                                                       CapyPDF_DeviceColorspace output_format,
-                                                      CapyPDF_Rendering_Intent intent) const {
+                                                      CapyPDF_Rendering_Intent intent,
+                                                      uint32_t num_threads) const {
     RasterImage converted;
     converted.md = ri.md;
-    converted.alpha = std::move(ri.alpha);
+    converted.alpha = ri.alpha;
     cmsHPROFILE input_profile;
     const uint32_t input_pixelformat = pixelformat_for(ri.md.cs);
     const uint32_t output_pixelformat = pixelformat_for(output_format);
     const uint32_t num_pixels = ri.md.w * ri.md.h;
     LcmsHolder icc_holder;
+    bool own_transform = false;
     if(ri.icc_profile.empty()) {
         input_profile = profile_for(ri.md.cs);
     } else {
@@ -246,6 +264,9 @@ rvoe<RasterImage> PdfColorConverter::convert_image_to(RasterImage ri,
             RETERR(InvalidICCProfile);
         }
         icc_holder.h = input_profile;
+        // Embedded profiles are short-lived, so their transforms can not
+        // go in the cache, whose entries are keyed by profile handle.
+        own_transform = true;
     }
 
     if(!input_profile) {
@@ -256,18 +277,61 @@ rvoe<RasterImage> PdfColorConverter::convert_image_to(RasterImage ri,
         RETERR(OutputProfileMissing);
     }
 
-    auto transform = cmsCreateTransform(input_profile,
-                                        input_pixelformat,
-                                        output_profile,
-                                        output_pixelformat,
-                                        ri2lcms.at(intent),
-                                        0);
+    cmsHTRANSFORM transform;
+    if(own_transform) {
+        transform = cmsCreateTransform(input_profile,
+                                       input_pixelformat,
+                                       output_profile,
+                                       output_pixelformat,
+                                       ri2lcms.at(intent),
+                                       cmsFLAGS_NOCACHE);
+    } else {
+        transform = get_transform(input_profile,
+                                  input_pixelformat,
+                                  output_profile,
+                                  output_pixelformat,
+                                  ri2lcms.at(intent));
+    }
     if(!transform) {
         RETERR(ProfileProblem);
     }
     converted.pixels = std::string(num_pixels * num_bytes_for(output_format), '\0');
-    cmsDoTransform(transform, ri.pixels.data(), converted.pixels.data(), num_pixels);
-    cmsDeleteTransform(transform);
+    const auto *input_bytes = ri.pixel_data().data();
+    if(num_threads == 0) {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    num_threads = std::min(num_threads, std::max(num_pixels / MIN_PIXELS_PER_THREAD, 1u));
+    if(num_threads > 1) {
+        // The whole buffer is handed to lcms in contiguous slices, one
+        // per worker. The transform is sharable because it was created
+        // with NOCACHE.
+        const uint32_t in_bpp = num_bytes_for(ri.md.cs);
+        const uint32_t out_bpp = num_bytes_for(output_format);
+        const uint32_t pixels_per_thread = (num_pixels + num_threads - 1) / num_threads;
+        std::vector<std::thread> workers;
+        workers.reserve(num_threads);
+        for(uint32_t tid = 0; tid < num_threads; ++tid) {
+            const uint32_t start = tid * pixels_per_thread;
+            if(start >= num_pixels) {
+                break;
+            }
+            const uint32_t count = std::min(pixels_per_thread, num_pixels - start);
+            workers.emplace_back([&, start, count]() {
+                cmsDoTransform(transform,
+                               input_bytes + (size_t)start * in_bpp,
+                               converted.pixels.data() + (size_t)start * out_bpp,
+                               count);
+            });
+        }
+        for(auto &w : workers) {
+            w.join();
+        }
+    } else {
+        cmsDoTransform(transform, input_bytes, converted.pixels.data(), num_pixels);
+    }
+    if(own_transform) {
+        cmsDeleteTransform(transform);
+    }
     converted.md.cs = (CapyPDF_ImageColorspace)output_format;
     converted.icc_profile.clear();
     return std::move(converted);
@@ -8,9 +8,12 @@
 #include <string>
 #include <expected>
 #include <filesystem>
+#include <map>
+#include <tuple>
 
 // To avoid pulling all of LittleCMS in this file.
 typedef void *cmsHPROFILE;
+typedef void *cmsHTRANSFORM;
 
 namespace capypdf {
 
@@ -50,9 +53,10 @@ public:
     DeviceGrayColor to_gray(const DeviceCMYKColor &cmyk);
     rvoe<DeviceCMYKColor> to_cmyk(const DeviceRGBColor &rgb);
 
-    rvoe<RasterImage> convert_image_to(RasterImage ri,
+    rvoe<RasterImage> convert_image_to(const RasterImage &ri,
                                        CapyPDF_DeviceColorspace output_format,
-                                       CapyPDF_Rendering_Intent intent) const;
+                                       CapyPDF_Rendering_Intent intent,
+                                       uint32_t num_threads = 1) const;
 
     const std::string &get_rgb() const { return rgb_profile_data; }
     const std::string &get_gray() const { return gray_profile_data; }
@@ -68,12 +72,22 @@ private:
     cmsHPROFILE profile_for(CapyPDF_DeviceColorspace cs) const;
     cmsHPROFILE profile_for(CapyPDF_ImageColorspace cs) const;
 
+    // Returns a cached transform between two of the converter's own
+    // long-lived profiles, creating it on first use. The transforms are
+    // created cache-free so one instance can be shared between threads.
+    cmsHTRANSFORM get_transform(cmsHPROFILE input,
+                                uint32_t input_format,
+                                cmsHPROFILE output,
+                                uint32_t output_format,
+                                int lcms_intent) const;
+
     LcmsHolder rgb_profile;
     LcmsHolder gray_profile;
     LcmsHolder cmyk_profile;
 
     std::string rgb_profile_data, gray_profile_data, cmyk_profile_data;
-    // FIXME, store transforms so that they don't get recreated all the time.
+    typedef std::tuple<cmsHPROFILE, uint32_t, cmsHPROFILE, uint32_t, int> TransformKey;
+    mutable std::map<TransformKey, cmsHTRANSFORM> transform_cache;
 };
 
 } // namespace capypdf
@@ -465,11 +465,62 @@ struct RasterImageMetadata {
     CapyPDF_Compression compression = CAPY_COMPRESSION_NONE;
 };
 
+// A caller owned buffer lent to capypdf. The release callback, if any,
+// is invoked exactly once when the borrow is dropped.
+class BorrowedBytes {
+public:
+    BorrowedBytes() = default;
+    BorrowedBytes(const char *buf, size_t bufsize, void (*release_cb)(void *), void *user_data)
+        : buf{buf}, bufsize{bufsize}, release_cb{release_cb}, user_data{user_data} {}
+    BorrowedBytes(BorrowedBytes &&o) noexcept { *this = std::move(o); }
+    BorrowedBytes(const BorrowedBytes &) = delete;
+    BorrowedBytes &operator=(BorrowedBytes &&o) noexcept {
+        if(this != &o) {
+            release();
+            buf = o.buf;
+            bufsize = o.bufsize;
+            release_cb = o.release_cb;
+            user_data = o.user_data;
+            o.buf = nullptr;
+            o.bufsize = 0;
+            o.release_cb = nullptr;
+            o.user_data = nullptr;
+        }
+        return *this;
+    }
+    BorrowedBytes &operator=(const BorrowedBytes &) = delete;
+    ~BorrowedBytes() { release(); }
+
+    std::string_view sv() const { return std::string_view{buf, bufsize}; }
+    bool empty() const { return bufsize == 0; }
+
+private:
+    void release() {
+        if(release_cb) {
+            release_cb(user_data);
+        }
+        buf = nullptr;
+        bufsize = 0;
+        release_cb = nullptr;
+    }
+
+    const char *buf = nullptr;
+    size_t bufsize = 0;
+    void (*release_cb)(void *) = nullptr;
+    void *user_data = nullptr;
+};
+
 struct RasterImage {
     RasterImageMetadata md;
     std::string pixels;
     std::string alpha;
     std::string icc_profile;
+    // Set when the pixels are borrowed from the caller instead of owned.
+    BorrowedBytes borrowed_pixels;
+
+    std::string_view pixel_data() const {
+        return borrowed_pixels.empty() ? std::string_view{pixels} : borrowed_pixels.sv();
+    }
 };
 
 struct jpg_image {
@@ -478,6 +529,33 @@ struct jpg_image {
     std::string file_contents;
 };
 
+// Counters for visibility into where generation time goes. Updated
+// with plain additions at a handful of points, so the overhead is
+// negligible whether anyone reads them or not.
+struct GenerationStats {
+    int64_t objects_written = 0;
+    int64_t bytes_written = 0;
+    // Indexed by CapyPDF_Stream_Class.
+    int64_t deflate_bytes_in[3] = {0, 0, 0};
+    int64_t deflate_bytes_out[3] = {0, 0, 0};
+    double deflate_seconds = 0;
+    double subset_seconds = 0;
+    double image_decode_seconds = 0;
+    double write_seconds = 0;
+};
+
+// A PNG whose compressed pixel data is copied into the output stream
+// as is, without a decode and re-encode round trip.
+struct png_raw_image {
+    int32_t w = 0;
+    int32_t h = 0;
+    int32_t bit_depth = 0;
+    int32_t num_channels = 0; // 1 for grayscale and palette images, 3 for RGB.
+    bool indexed = false;
+    std::string palette; // Raw RGB triplets of an /Indexed colorspace.
+    std::string idat;    // The zlib stream from the IDAT chunks.
+};
+
 struct ImagePDFProperties {
     CapyPDF_Image_Interpolation interp = CAPY_INTERPOLATION_AUTO;
     bool as_mask = false;
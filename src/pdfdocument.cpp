@@ -2,10 +2,14 @@
 // Copyright 2023-2024 Jussi Pakkanen
 
 #include <pdfdocument.hpp>
+#include <pdfwriter.hpp>
 #include <utils.hpp>
 #include <pdfdrawcontext.hpp>
 
 #include <cassert>
+#include <cctype>
+#include <charconv>
+#include <cstring>
 #include <array>
 #include <map>
 #include <bit>
@@ -226,6 +230,246 @@ const std::array<const char *, 4> rendering_intent_names{
     "Perceptual",
 };
 
+namespace {
+
+// Parses a nonnegative integer at or after the given offset, skipping
+// leading whitespace.
+rvoe<int64_t> parse_pdf_integer(std::string_view buf, size_t offset) {
+    while(offset < buf.size() && (buf[offset] == ' ' || buf[offset] == '\n' || buf[offset] == '\r')) {
+        ++offset;
+    }
+    int64_t value{};
+    const auto rc = std::from_chars(buf.data() + offset, buf.data() + buf.size(), value);
+    if(rc.ec != std::errc{} || value < 0) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    return value;
+}
+
+// Finds "/Key num" in the given slice and parses the number.
+rvoe<int64_t> parse_dict_integer(std::string_view buf, const char *key) {
+    const auto loc = buf.find(key);
+    if(loc == std::string_view::npos) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    return parse_pdf_integer(buf, loc + strlen(key));
+}
+
+std::string_view object_slice(std::string_view contents, uint64_t offset) {
+    if(offset >= contents.size()) {
+        return {};
+    }
+    auto slice = contents.substr(offset);
+    const auto endloc = slice.find("endobj");
+    if(endloc != std::string_view::npos) {
+        slice = slice.substr(0, endloc);
+    }
+    return slice;
+}
+
+} // namespace
+
+rvoe<IncrementalBaseInfo> load_incremental_base(const std::filesystem::path &fname) {
+    ERC(contents, load_file(fname));
+    IncrementalBaseInfo base;
+    // Locate the final cross reference section.
+    const auto sxloc = contents.rfind("startxref");
+    if(sxloc == std::string::npos) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    ERC(xref_offset, parse_pdf_integer(contents, sxloc + strlen("startxref")));
+    if((size_t)xref_offset >= contents.size()) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    base.xref_offset = xref_offset;
+    std::string_view xref = std::string_view{contents}.substr(xref_offset);
+    // Files written with object streams store their trailer inside a
+    // cross reference stream, which would need a full PDF parser.
+    if(!xref.starts_with("xref")) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    const auto header_end = xref.find('\n', xref.find('\n') + 1);
+    if(header_end == std::string_view::npos || !xref.substr(5).starts_with("0 ")) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    ERC(num_objects, parse_pdf_integer(xref, 5 + 2));
+    // Cross reference rows have a fixed 20 byte size.
+    const size_t row_size = 20;
+    if(xref.size() < header_end + 1 + (size_t)num_objects * row_size) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    base.object_offsets.reserve(num_objects);
+    for(int64_t i = 0; i < num_objects; ++i) {
+        ERC(entry_offset, parse_pdf_integer(xref, header_end + 1 + i * row_size));
+        base.object_offsets.push_back((uint64_t)entry_offset);
+    }
+    const auto trailer = xref.substr(header_end + 1 + num_objects * row_size);
+    ERC(root_obj, parse_dict_integer(trailer, "/Root"));
+    if(root_obj <= 0 || root_obj >= num_objects) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    const auto catalog = object_slice(contents, base.object_offsets.at(root_obj));
+    ERC(pages_obj, parse_dict_integer(catalog, "/Pages"));
+    if(pages_obj <= 0 || pages_obj >= num_objects) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    base.pages_object = (int32_t)pages_obj;
+    if(trailer.find("/Info") != std::string_view::npos) {
+        ERC(info_obj, parse_dict_integer(trailer, "/Info"));
+        base.info_object = (int32_t)info_obj;
+    } else {
+        base.info_object = 0;
+    }
+    const auto pagetree = object_slice(contents, base.object_offsets.at(pages_obj));
+    ERC(page_count, parse_dict_integer(pagetree, "/Count"));
+    base.page_count = (int32_t)page_count;
+    auto kidloc = pagetree.find("/Kids");
+    if(kidloc == std::string_view::npos) {
+        RETERR(IncrementalBaseUnsupported);
+    }
+    auto kids = pagetree.substr(kidloc);
+    kids = kids.substr(0, kids.find(']'));
+    size_t loc = kids.find('[') + 1;
+    while(loc < kids.size()) {
+        while(loc < kids.size() && !isdigit((unsigned char)kids[loc])) {
+            ++loc;
+        }
+        if(loc >= kids.size()) {
+            break;
+        }
+        int32_t kid{};
+        const auto rc = std::from_chars(kids.data() + loc, kids.data() + kids.size(), kid);
+        if(rc.ec != std::errc{}) {
+            RETERR(IncrementalBaseUnsupported);
+        }
+        base.page_kids.push_back(kid);
+        // Skip over the generation number and "R".
+        loc = kids.find('R', rc.ptr - kids.data());
+        if(loc == std::string_view::npos) {
+            break;
+        }
+        ++loc;
+    }
+    base.contents = std::move(contents);
+    return base;
+}
+
+rvoe<NoReturnValue> merge_shards(const std::vector<std::filesystem::path> &shard_files,
+                                 const std::filesystem::path &ofilename) {
+    if(shard_files.empty()) {
+        RETERR(ShardMergeUnsupported);
+    }
+    std::vector<IncrementalBaseInfo> shards;
+    shards.reserve(shard_files.size());
+    size_t table_size = 0;
+    for(const auto &shard_file : shard_files) {
+        ERC(shard, load_incremental_base(shard_file));
+        table_size = std::max(table_size, shard.object_offsets.size());
+        shards.push_back(std::move(shard));
+    }
+    // Every used object number must belong to exactly one shard, which
+    // holds when the shards were generated with shard_object_offset
+    // blocks that do not overlap. Shard bytes are copied into the
+    // output back to back, so an object's offset in the merged file is
+    // its shard offset plus the shard's starting position.
+    std::vector<uint64_t> object_offsets(table_size, 0);
+    uint64_t shard_base = 0;
+    int64_t total_pages = 0;
+    for(const auto &shard : shards) {
+        for(size_t i = 1; i < shard.object_offsets.size(); ++i) {
+            const auto offset = shard.object_offsets[i];
+            if(offset == 0) {
+                continue;
+            }
+            if(object_offsets[i] != 0) {
+                RETERR(ShardMergeUnsupported);
+            }
+            object_offsets[i] = shard_base + offset;
+        }
+        shard_base += shard.contents.size();
+        total_pages += shard.page_count;
+    }
+    const int32_t root_object = (int32_t)object_offsets.size();
+    const int32_t catalog_object = root_object + 1;
+    object_offsets.resize(object_offsets.size() + 2, 0);
+    std::string tail;
+    auto app = std::back_inserter(tail);
+    for(const auto &shard : shards) {
+        // The shard's page tree root is regenerated under its old
+        // number so it can point to the root node of the merged tree.
+        // The original bytes stay in the output but become unreferenced,
+        // as do the shard catalogs and trailers.
+        object_offsets.at(shard.pages_object) = shard_base + tail.size();
+        std::format_to(app, "{} 0 obj\n<<\n  /Type /Pages\n  /Kids [\n", shard.pages_object);
+        for(const auto &kid : shard.page_kids) {
+            std::format_to(app, "    {} 0 R\n", kid);
+        }
+        std::format_to(app,
+                       "  ]\n  /Count {}\n  /Parent {} 0 R\n>>\nendobj\n",
+                       shard.page_count,
+                       root_object);
+    }
+    object_offsets.at(root_object) = shard_base + tail.size();
+    std::format_to(app, "{} 0 obj\n<<\n  /Type /Pages\n  /Kids [\n", root_object);
+    for(const auto &shard : shards) {
+        std::format_to(app, "    {} 0 R\n", shard.pages_object);
+    }
+    std::format_to(app, "  ]\n  /Count {}\n>>\nendobj\n", total_pages);
+    object_offsets.at(catalog_object) = shard_base + tail.size();
+    std::format_to(app,
+                   "{} 0 obj\n<<\n  /Type /Catalog\n  /Pages {} 0 R\n>>\nendobj\n",
+                   catalog_object,
+                   root_object);
+    const uint64_t xref_offset = shard_base + tail.size();
+    std::format_to(app, "xref\n0 {}\n", object_offsets.size());
+    for(size_t i = 0; i < object_offsets.size(); ++i) {
+        if(i == 0 || object_offsets[i] == 0) {
+            tail += "0000000000 65535 f \n"; // The end of line whitespace is significant.
+        } else {
+            std::format_to(app, "{:010} 00000 n \n", object_offsets[i]);
+        }
+    }
+    std::format_to(app,
+                   "trailer\n<<\n  /Size {}\n  /Root {} 0 R\n",
+                   object_offsets.size(),
+                   catalog_object);
+    if(shards.front().info_object > 0) {
+        std::format_to(app, "  /Info {} 0 R\n", shards.front().info_object);
+    }
+    std::format_to(app, ">>\nstartxref\n{}\n%%EOF\n", xref_offset);
+    auto tempfname = ofilename;
+    tempfname.replace_extension(".pdf~");
+    FILE *ofile = fopen(tempfname.string().c_str(), "wb");
+    if(!ofile) {
+        perror(nullptr);
+        RETERR(CouldNotOpenFile);
+    }
+    for(const auto &shard : shards) {
+        if(fwrite(shard.contents.data(), 1, shard.contents.size(), ofile) !=
+           shard.contents.size()) {
+            perror(nullptr);
+            fclose(ofile);
+            RETERR(FileWriteError);
+        }
+    }
+    if(fwrite(tail.data(), 1, tail.size(), ofile) != tail.size()) {
+        perror(nullptr);
+        fclose(ofile);
+        RETERR(FileWriteError);
+    }
+    if(fclose(ofile) != 0) {
+        perror(nullptr);
+        RETERR(FileWriteError);
+    }
+    std::error_code ec;
+    std::filesystem::rename(tempfname, ofilename, ec);
+    if(ec) {
+        fprintf(stderr, "%s\n", ec.category().message(ec.value()).c_str());
+        RETERR(FileWriteError);
+    }
+    return NoReturnValue{};
+}
+
 rvoe<PdfDocument> PdfDocument::construct(const PdfGenerationData &d, PdfColorConverter cm) {
     PdfDocument newdoc(d, std::move(cm));
     ERCV(newdoc.init());
@@ -233,13 +477,124 @@ rvoe<PdfDocument> PdfDocument::construct(const PdfGenerationData &d, PdfColorCon
 }
 
 PdfDocument::PdfDocument(const PdfGenerationData &d, PdfColorConverter cm)
-    : opts{d}, cm{std::move(cm)} {}
+    : opts{d}, cm{std::move(cm)}, object_mutex{std::make_unique<std::mutex>()},
+      page_mutex{std::make_unique<std::mutex>()}, font_mutex{std::make_unique<std::mutex>()} {}
+
+rvoe<PdfDocument> PdfDocument::clone(PdfColorConverter new_cm, FT_Library ft) const {
+    if(stream_writer || write_attempted) {
+        RETERR(CloneUnsupported);
+    }
+    PdfDocument d(opts, std::move(new_cm));
+    d.document_objects.reserve(document_objects.size());
+    for(const auto &obj : document_objects) {
+        // A memory mapped stream holds a kernel resource that copying
+        // the object would not duplicate.
+        if(std::holds_alternative<MappedFilePDFObject>(obj) ||
+           std::holds_alternative<DeflateMappedFilePDFObject>(obj)) {
+            RETERR(CloneUnsupported);
+        }
+        d.document_objects.push_back(std::visit(
+            [](const auto &o) -> ObjectType {
+                using T = std::decay_t<decltype(o)>;
+                if constexpr(std::is_same_v<T, MappedFilePDFObject> ||
+                             std::is_same_v<T, DeflateMappedFilePDFObject>) {
+                    return DummyIndexZero{};
+                } else {
+                    return o;
+                }
+            },
+            obj));
+    }
+    d.pages = pages;
+    d.image_info = image_info;
+    d.builtin_fonts = builtin_fonts;
+    d.font_objects = font_objects;
+    d.separation_objects = separation_objects;
+    // The parsed font data is immutable and shared, only the FreeType
+    // face and the mutable subset state are per-clone.
+    d.fonts.reserve(fonts.size());
+    for(const auto &f : fonts) {
+        FT_Face face;
+        auto error = FT_New_Face(ft, f.fontdata.source_file.string().c_str(), 0, &face);
+        if(error) {
+            RETERR(FreeTypeError);
+        }
+        TtfFont ttf{std::unique_ptr<FT_FaceRec_, FT_Error (*)(FT_Face)>{face, guarded_face_close},
+                    f.fontdata.fontdata,
+                    f.fontdata.source_file};
+        d.fonts.emplace_back(FontThingy{std::move(ttf), f.subsets.clone_with_face(face)});
+    }
+    d.outlines = outlines;
+    d.icc_profiles = icc_profiles;
+    d.form_xobjects = form_xobjects;
+    d.form_widgets = form_widgets;
+    d.embedded_files = embedded_files;
+    d.annotations = annotations;
+    d.structure_items = structure_items;
+    d.ocg_items = ocg_items;
+    d.transparency_groups = transparency_groups;
+    d.rolemap = rolemap;
+    d.image_dedup = image_dedup;
+    d.icc_dedup = icc_dedup;
+    d.embedded_file_dedup = embedded_file_dedup;
+    d.graphics_state_dedup = graphics_state_dedup;
+    d.uri_action_dedup = uri_action_dedup;
+    d.resource_dict_dedup = resource_dict_dedup;
+    d.form_use = form_use;
+    d.annotation_use = annotation_use;
+    d.structure_use = structure_use;
+    d.structure_parent_tree_items = structure_parent_tree_items;
+    d.parent_tree_leaves = parent_tree_leaves;
+    d.output_profile = output_profile;
+    d.output_intent_object = output_intent_object;
+    d.structure_root_object = structure_root_object;
+    d.structure_parent_tree_object = structure_parent_tree_object;
+    d.pages_object = pages_object;
+    d.page_group_object = page_group_object;
+    d.page_parents = page_parents;
+    d.page_tree_root_kids = page_tree_root_kids;
+    d.incremental_base = incremental_base;
+    d.stats = stats;
+    // The trace callback is not copied. Its context pointer belongs to
+    // whoever set it on the original document.
+    return std::move(d);
+}
 
 rvoe<NoReturnValue> PdfDocument::init() {
     // PDF uses 1-based indexing so add a dummy thing in this vector
     // to make PDF and vector indices are the same.
     document_objects.emplace_back(DummyIndexZero{});
-    generate_info_object();
+    if(opts.shard_object_offset > 0) {
+        // Object streams would renumber everything and an incremental
+        // base brings its own object table, neither mixes with
+        // reserving a numbering block for other shards.
+        if(opts.use_object_streams || !opts.incremental_base.empty()) {
+            RETERR(BadOptionCombination);
+        }
+        // Reserved slots are never written and show up as free entries
+        // in this shard's cross reference table.
+        for(int32_t i = 0; i < opts.shard_object_offset; ++i) {
+            document_objects.emplace_back(DummyIndexZero{});
+        }
+    }
+    if(!opts.incremental_base.empty()) {
+        if(opts.streamed_writes || opts.use_object_streams) {
+            RETERR(BadOptionCombination);
+        }
+        ERC(base, load_incremental_base(opts.incremental_base));
+        // Base objects keep their numbers and offsets, only objects
+        // added after this point get appended to the file. The page
+        // tree object is regenerated so it can list both old and new
+        // pages, keeping the /Parent entries of base pages valid.
+        for(size_t i = 1; i < base.object_offsets.size(); ++i) {
+            document_objects.push_back(WrittenObject{(int64_t)base.object_offsets[i]});
+        }
+        pages_object = base.pages_object;
+        document_objects.at(pages_object) = DelayedPages{};
+        incremental_base = std::move(base);
+    } else {
+        generate_info_object();
+    }
     if(opts.output_colorspace == CAPY_DEVICE_CS_CMYK) {
         create_separation(asciistring::from_cstr("All").value(),
                           DeviceCMYKColor{1.0, 1.0, 1.0, 1.0});
@@ -263,8 +618,10 @@ rvoe<NoReturnValue> PdfDocument::init() {
         break;
     }
     page_group_object = create_page_group();
-    document_objects.push_back(DelayedPages{});
-    pages_object = document_objects.size() - 1;
+    if(!incremental_base) {
+        document_objects.push_back(DelayedPages{});
+        pages_object = document_objects.size() - 1;
+    }
     if(opts.xtype) {
         if(!output_profile) {
             RETERR(OutputProfileMissing);
@@ -287,15 +644,32 @@ int32_t PdfDocument::create_page_group() {
     return add_object(FullPDFObject{std::move(buf), {}});
 }
 
-rvoe<NoReturnValue> PdfDocument::add_page(std::string resource_dict,
-                                          std::string unclosed_object_dict,
-                                          std::string command_stream,
-                                          const PageProperties &custom_props,
-                                          const std::unordered_set<CapyPDF_FormWidgetId> &fws,
-                                          const std::unordered_set<CapyPDF_AnnotationId> &annots,
-                                          const std::vector<CapyPDF_StructureItemId> &structs,
-                                          const std::optional<Transition> &transition,
-                                          const std::vector<SubPageNavigation> &subnav) {
+rvoe<int32_t> PdfDocument::add_page(std::string resource_dict,
+                                    std::string unclosed_object_dict,
+                                    std::string command_stream,
+                                    const PageProperties &custom_props,
+                                    const std::unordered_set<CapyPDF_FormWidgetId> &fws,
+                                    const std::unordered_set<CapyPDF_AnnotationId> &annots,
+                                    const std::vector<CapyPDF_StructureItemId> &structs,
+                                    const std::optional<Transition> &transition,
+                                    const std::vector<SubPageNavigation> &subnav) {
+    // Add the content object before taking the page lock so parallel
+    // page builders compress and hand off their streams without
+    // serializing on each other. If the validation below fails the
+    // object stays in the file unused, but a failing add_page means
+    // the document is abandoned anyway.
+    int32_t commands_num{-1};
+    if(opts.compress_streams) {
+        commands_num = add_object(
+            DeflatePDFObject{std::move(unclosed_object_dict), std::move(command_stream)});
+    } else {
+        std::format_to(std::back_inserter(unclosed_object_dict),
+                       "  /Length {}\n>>\n",
+                       command_stream.length());
+        commands_num =
+            add_object(FullPDFObject{std::move(unclosed_object_dict), std::move(command_stream)});
+    }
+    std::lock_guard<std::mutex> page_lock(*page_mutex);
     for(const auto &a : fws) {
         if(form_use.find(a) != form_use.cend()) {
             RETERR(AnnotationReuse);
@@ -311,17 +685,17 @@ rvoe<NoReturnValue> PdfDocument::add_page(std::string resource_dict,
             RETERR(StructureReuse);
         }
     }
-    const auto resource_num = add_object(FullPDFObject{std::move(resource_dict), {}});
-    int32_t commands_num{-1};
-    if(opts.compress_streams) {
-        commands_num = add_object(
-            DeflatePDFObject{std::move(unclosed_object_dict), std::move(command_stream)});
+    // Pages with identical resource sets are common in bulk documents.
+    // The dictionary is serialized in a canonical order, so equal sets
+    // produce equal bytes and can share one /Resources object.
+    int32_t resource_num{-1};
+    const auto resource_hash = hash_bytes(resource_dict);
+    auto rd_it = resource_dict_dedup.find(resource_hash);
+    if(rd_it != resource_dict_dedup.end()) {
+        resource_num = rd_it->second;
     } else {
-        std::format_to(std::back_inserter(unclosed_object_dict),
-                       "  /Length {}\n>>\n",
-                       command_stream.length());
-        commands_num =
-            add_object(FullPDFObject{std::move(unclosed_object_dict), std::move(command_stream)});
+        resource_num = add_object(FullPDFObject{std::move(resource_dict), {}});
+        resource_dict_dedup.emplace(resource_hash, resource_num);
     }
     DelayedPage p;
     p.page_num = (int32_t)pages.size();
@@ -332,6 +706,13 @@ rvoe<NoReturnValue> PdfDocument::add_page(std::string resource_dict,
     for(const auto &a : annots) {
         p.used_annotations.push_back(CapyPDF_AnnotationId{a});
     }
+    // The bucket is filled from an unordered set, sort it so the
+    // /Annots array comes out in creation order.
+    std::sort(p.used_annotations.begin(),
+              p.used_annotations.end(),
+              [](const CapyPDF_AnnotationId &a, const CapyPDF_AnnotationId &b) {
+                  return a.id < b.id;
+              });
     p.transition = transition;
     if(!subnav.empty()) {
         p.subnav_root = create_subnavigation(subnav);
@@ -339,6 +720,7 @@ rvoe<NoReturnValue> PdfDocument::add_page(std::string resource_dict,
     if(!structs.empty()) {
         p.structparents = (int32_t)structure_parent_tree_items.size();
         structure_parent_tree_items.push_back(structs);
+        flush_parent_tree_leaf(false);
     }
     const auto page_object_num = add_object(std::move(p));
     for(const auto &fw : fws) {
@@ -352,17 +734,25 @@ rvoe<NoReturnValue> PdfDocument::add_page(std::string resource_dict,
         structure_use[s] = StructureUsage{(int32_t)pages.size(), mcid_num++};
     }
     pages.emplace_back(PageOffsets{resource_num, commands_num, page_object_num});
-    return NoReturnValue{};
+    return (int32_t)pages.size() - 1;
 }
 
 void PdfDocument::add_form_xobject(std::string xobj_dict, std::string xobj_stream) {
-    const auto xobj_num = add_object(FullPDFObject{std::move(xobj_dict), std::move(xobj_stream)});
+    // The content stream is compressed once, so stamping the same form
+    // on every page does not redo any serialization work.
+    const auto xobj_num = add_object(DeflatePDFObject{std::move(xobj_dict), std::move(xobj_stream)});
 
     form_xobjects.emplace_back(FormXObjectInfo{xobj_num});
 }
 
 int32_t PdfDocument::create_subnavigation(const std::vector<SubPageNavigation> &subnav) {
     assert(!subnav.empty());
+    // The nodes reference each other by object number, so the whole
+    // span must be contiguous. Hold the object lock for the duration
+    // and append directly instead of going through add_object, which
+    // would deadlock. The objects stay buffered until write time, but
+    // subnavigation trees are tiny.
+    std::lock_guard<std::mutex> lock(*object_mutex);
     const int32_t root_obj = document_objects.size();
     {
         std::string rootbuf{
@@ -388,7 +778,7 @@ int32_t PdfDocument::create_subnavigation(const std::vector<SubPageNavigation> &
         rootbuf += "    ]\n  >>\n";
         std::format_to(rootapp, "  /Prev {} 0 R\n>>\n", root_obj + 1 + subnav.size());
 
-        add_object(FullPDFObject{std::move(rootbuf), {}});
+        document_objects.push_back(FullPDFObject{std::move(rootbuf), {}});
     }
     int32_t first_obj = document_objects.size();
 
@@ -425,9 +815,9 @@ int32_t PdfDocument::create_subnavigation(const std::vector<SubPageNavigation> &
             std::format_to(app, "  /Prev {} 0 R\n", first_obj + i - 1);
         }
         buf += ">>\n";
-        add_object(FullPDFObject{std::move(buf), {}});
+        document_objects.push_back(FullPDFObject{std::move(buf), {}});
     }
-    add_object(FullPDFObject{std::format(R"(<<
+    document_objects.push_back(FullPDFObject{std::format(R"(<<
   /Type /NavNode
   /PA <<
     /S /SetOCGState
@@ -436,14 +826,66 @@ int32_t PdfDocument::create_subnavigation(const std::vector<SubPageNavigation> &
   /Prev {} 0 R
 >>
 )",
-                                         ocg_object_number(subnav.back().id),
-                                         first_obj + subnav.size() - 1),
-                             {}});
+                                                         ocg_object_number(subnav.back().id),
+                                                         first_obj + subnav.size() - 1),
+                                             {}});
     return root_obj;
 }
 
 int32_t PdfDocument::add_object(ObjectType object) {
+    // Compress before taking the lock so concurrent page builders
+    // deflate their content streams in parallel instead of
+    // serializing on each other.
+    std::optional<std::string> compressed;
+    double compress_seconds = 0;
+    if(stream_writer) {
+        if(auto *defl = std::get_if<DeflatePDFObject>(&object)) {
+            const auto start = std::chrono::steady_clock::now();
+            auto rc = flate_compress(
+                defl->stream, opts.num_threads, opts.compression.level_for(defl->stream_class));
+            compress_seconds = seconds_since(start);
+            if(rc) {
+                compressed = std::move(*rc);
+            }
+        }
+    }
+    std::lock_guard<std::mutex> lock(*object_mutex);
+    stats.deflate_seconds += compress_seconds;
     auto object_num = (int32_t)document_objects.size();
+    if(stream_writer) {
+        // Fully finished objects can be written out immediately. If
+        // writing fails, keep the object buffered so the error surfaces
+        // when the document itself is written.
+        if(auto *full = std::get_if<FullPDFObject>(&object);
+           full && !(opts.use_object_streams && full->stream.empty())) {
+            auto offset =
+                stream_writer->write_streamed_object(object_num, full->dictionary, full->stream);
+            if(offset) {
+                document_objects.push_back(WrittenObject{offset.value()});
+                return object_num;
+            }
+        } else if(auto *mapped = std::get_if<MappedFilePDFObject>(&object)) {
+            auto offset = stream_writer->write_streamed_object(
+                object_num, mapped->dictionary, mapped->file.sv());
+            if(offset) {
+                document_objects.push_back(WrittenObject{offset.value()});
+                return object_num;
+            }
+        } else if(auto *defl = std::get_if<DeflatePDFObject>(&object)) {
+            if(compressed) {
+                stats.deflate_bytes_in[defl->stream_class] += defl->stream.size();
+                stats.deflate_bytes_out[defl->stream_class] += compressed->size();
+                std::string dict = std::format("{}  /Filter /FlateDecode\n  /Length {}\n>>\n",
+                                               defl->unclosed_dictionary,
+                                               compressed->size());
+                auto offset = stream_writer->write_streamed_object(object_num, dict, *compressed);
+                if(offset) {
+                    document_objects.push_back(WrittenObject{offset.value()});
+                    return object_num;
+                }
+            }
+        }
+    }
     document_objects.push_back(std::move(object));
     return object_num;
 }
@@ -506,7 +948,8 @@ rvoe<CapyPDF_LabColorSpaceId> PdfDocument::add_lab_colorspace(const LabColorSpac
 }
 
 rvoe<CapyPDF_IccColorSpaceId> PdfDocument::load_icc_file(const std::filesystem::path &fname) {
-    ERC(contents, load_file(fname));
+    ERC(mapping, MappedFile::map(fname));
+    const auto contents = mapping.sv();
     const auto iccid = find_icc_profile(contents);
     if(iccid) {
         return *iccid;
@@ -522,6 +965,10 @@ void PdfDocument::pad_subset_fonts() {
     for(auto &sf : fonts) {
         auto &subsetter = sf.subsets;
         assert(subsetter.num_subsets() > 0);
+        if(subsetter.is_cid()) {
+            // The location 32 requirement does not apply to CID-keyed fonts.
+            continue;
+        }
         const auto subset_id = subsetter.num_subsets() - 1;
         if(subsetter.get_subset(subset_id).size() > SPACE) {
             continue;
@@ -545,6 +992,85 @@ void PdfDocument::pad_subset_fonts() {
     }
 }
 
+void PdfDocument::build_page_tree() {
+    const size_t fanout = 32;
+    page_parents.assign(pages.size(), pages_object);
+    page_tree_root_kids.clear();
+    // An incremental update regenerates the root node in place and lists
+    // the base pages flat, since their parent entries can not be changed.
+    if(incremental_base || pages.size() <= fanout) {
+        return;
+    }
+    struct TreeNode {
+        size_t first_child; // Index into the previous level.
+        size_t num_children;
+        size_t num_pages; // Total leaf pages beneath this node.
+        int32_t obj_num;
+    };
+    // Group bottom-up until one level fits under the root.
+    std::vector<std::vector<TreeNode>> levels;
+    size_t prev_level_size = pages.size();
+    while(prev_level_size > fanout) {
+        std::vector<TreeNode> level;
+        level.reserve((prev_level_size + fanout - 1) / fanout);
+        for(size_t start = 0; start < prev_level_size; start += fanout) {
+            const auto num_children = std::min(fanout, prev_level_size - start);
+            size_t num_leaf_pages = 0;
+            if(levels.empty()) {
+                num_leaf_pages = num_children;
+            } else {
+                for(size_t c = start; c < start + num_children; ++c) {
+                    num_leaf_pages += levels.back().at(c).num_pages;
+                }
+            }
+            level.push_back(TreeNode{start, num_children, num_leaf_pages, -1});
+        }
+        prev_level_size = level.size();
+        levels.push_back(std::move(level));
+    }
+    // Object numbers are handed out sequentially, so they can be
+    // computed for the entire tree before any node is created.
+    int32_t next_obj_num = (int32_t)document_objects.size();
+    for(auto &level : levels) {
+        for(auto &node : level) {
+            node.obj_num = next_obj_num++;
+        }
+    }
+    for(size_t l = 0; l < levels.size(); ++l) {
+        auto &level = levels[l];
+        for(size_t n = 0; n < level.size(); ++n) {
+            auto &node = level[n];
+            const int32_t parent = l + 1 < levels.size()
+                                       ? levels[l + 1].at(n / fanout).obj_num
+                                       : pages_object;
+            std::string buf = std::format(R"(<<
+  /Type /Pages
+  /Parent {} 0 R
+  /Kids [
+)",
+                                          parent);
+            auto app = std::back_inserter(buf);
+            for(size_t c = node.first_child; c < node.first_child + node.num_children; ++c) {
+                const int32_t kid =
+                    l == 0 ? pages.at(c).page_obj_num : levels[l - 1].at(c).obj_num;
+                std::format_to(app, "    {} 0 R\n", kid);
+            }
+            std::format_to(app, "  ]\n  /Count {}\n>>\n", node.num_pages);
+            const auto written_num = add_object(FullPDFObject{std::move(buf), {}});
+            assert(written_num == node.obj_num);
+            (void)written_num;
+            if(l == 0) {
+                for(size_t c = node.first_child; c < node.first_child + node.num_children; ++c) {
+                    page_parents.at(c) = node.obj_num;
+                }
+            }
+        }
+    }
+    for(const auto &top : levels.back()) {
+        page_tree_root_kids.push_back(top.obj_num);
+    }
+}
+
 rvoe<int32_t> PdfDocument::create_name_dict() {
     assert(!embedded_files.empty());
     std::string buf = std::format(R"(<<
@@ -562,10 +1088,25 @@ rvoe<int32_t> PdfDocument::create_name_dict() {
     return add_object(FullPDFObject{std::move(buf), {}});
 }
 
-rvoe<int32_t> PdfDocument::create_structure_parent_tree() {
-    std::string buf = "<< /Nums [\n";
+// Number of keys in a full /ParentTree leaf node.
+static const size_t parent_tree_fanout = 64;
+
+// Serializes pending parent tree entries into a leaf node. Without
+// force this only happens once a full leaf's worth has accumulated, so
+// the serialization work is spread over the whole generation.
+void PdfDocument::flush_parent_tree_leaf(bool force) {
+    const size_t num_done = parent_tree_leaves.size() * parent_tree_fanout;
+    const size_t pending = structure_parent_tree_items.size() - num_done;
+    if(pending == 0 || (!force && pending < parent_tree_fanout)) {
+        return;
+    }
+    std::string buf;
     auto app = std::back_inserter(buf);
-    for(size_t i = 0; i < structure_parent_tree_items.size(); ++i) {
+    std::format_to(app,
+                   "<< /Limits [ {} {} ]\n  /Nums [\n",
+                   num_done,
+                   structure_parent_tree_items.size() - 1);
+    for(size_t i = num_done; i < structure_parent_tree_items.size(); ++i) {
         const auto &entry = structure_parent_tree_items[i];
         std::format_to(app, "  {} [\n", i);
         for(const auto &sitem : entry) {
@@ -574,6 +1115,20 @@ rvoe<int32_t> PdfDocument::create_structure_parent_tree() {
         buf += "  ]\n";
     }
     buf += "] >>\n";
+    parent_tree_leaves.push_back(add_object(FullPDFObject{std::move(buf), {}}));
+}
+
+rvoe<int32_t> PdfDocument::create_structure_parent_tree() {
+    flush_parent_tree_leaf(true);
+    if(parent_tree_leaves.empty()) {
+        return add_object(FullPDFObject{"<< /Nums [ ] >>\n", {}});
+    }
+    std::string buf = "<< /Kids [\n";
+    auto app = std::back_inserter(buf);
+    for(const auto &leaf : parent_tree_leaves) {
+        std::format_to(app, "    {} 0 R\n", leaf);
+    }
+    buf += "  ]\n>>\n";
     return add_object(FullPDFObject{std::move(buf), {}});
 }
 
@@ -855,13 +1410,9 @@ void PdfDocument::pad_subset_until_space(std::vector<TTGlyphs> &subset_glyphs) {
 }
 
 std::optional<CapyPDF_IccColorSpaceId> PdfDocument::find_icc_profile(std::string_view contents) {
-    for(size_t i = 0; i < icc_profiles.size(); ++i) {
-        const auto &stream_obj = document_objects.at(icc_profiles.at(i).stream_num);
-        assert(std::holds_alternative<DeflatePDFObject>(stream_obj));
-        const auto &stream_data = std::get<DeflatePDFObject>(stream_obj);
-        if(stream_data.stream == contents) {
-            return CapyPDF_IccColorSpaceId{(int32_t)i};
-        }
+    const auto existing = icc_dedup.find(hash_bytes(contents));
+    if(existing != icc_dedup.end()) {
+        return existing->second;
     }
     return {};
 }
@@ -883,7 +1434,9 @@ CapyPDF_IccColorSpaceId PdfDocument::store_icc_profile(std::string_view contents
     auto obj_id =
         add_object(FullPDFObject{std::format("[ /ICCBased {} 0 R ]\n", stream_obj_id), {}});
     icc_profiles.emplace_back(IccInfo{stream_obj_id, obj_id, num_channels});
-    return CapyPDF_IccColorSpaceId{(int32_t)icc_profiles.size() - 1};
+    const CapyPDF_IccColorSpaceId icc_id{(int32_t)icc_profiles.size() - 1};
+    icc_dedup.emplace(hash_bytes(contents), icc_id);
+    return icc_id;
 }
 
 rvoe<NoReturnValue> PdfDocument::generate_info_object() {
@@ -948,12 +1501,18 @@ CapyPDF_FontId PdfDocument::get_builtin_font_id(CapyPDF_Builtin_Fonts font) {
 
 uint32_t PdfDocument::glyph_for_codepoint(FT_Face face, uint32_t ucs4) {
     assert(face);
+    // FT_Face is not thread safe even for lookups.
+    std::lock_guard<std::mutex> lock(*font_mutex);
     return FT_Get_Char_Index(face, ucs4);
 }
 
 rvoe<SubsetGlyph> PdfDocument::get_subset_glyph(CapyPDF_FontId fid,
                                                 uint32_t codepoint,
                                                 const std::optional<uint32_t> glyph_id) {
+    // Subset state is shared between all draw contexts using the
+    // font, so glyph lookups from parallel page builds must not
+    // interleave.
+    std::lock_guard<std::mutex> lock(*font_mutex);
     if(!glyph_id && (FT_Get_Char_Index(fonts.at(fid.id).fontdata.face.get(), codepoint) == 0)) {
         RETERR(MissingGlyph);
     }
@@ -967,6 +1526,7 @@ rvoe<SubsetGlyph> PdfDocument::get_subset_glyph(CapyPDF_FontId fid,
 
 rvoe<SubsetGlyph>
 PdfDocument::get_subset_glyph(CapyPDF_FontId fid, const u8string &text, uint32_t glyph_id) {
+    std::lock_guard<std::mutex> lock(*font_mutex);
     ERC(blub, fonts.at(fid.id).subsets.get_glyph_subset(text, glyph_id));
     SubsetGlyph fss;
     fss.ss.fid = fid;
@@ -989,7 +1549,7 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_mask_image(RasterImage image,
                             image.md.cs,
                             std::optional<int32_t>{},
                             params,
-                            image.pixels,
+                            image.pixel_data(),
                             image.md.compression);
 }
 
@@ -997,7 +1557,7 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image(RasterImage image, const ImagePDFPr
     if(image.md.w <= 0 || image.md.h <= 0) {
         RETERR(InvalidImageSize);
     }
-    if(image.pixels.empty()) {
+    if(image.pixel_data().empty()) {
         RETERR(MissingPixels);
     }
     ERCV(validate_format(image));
@@ -1005,6 +1565,23 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image(RasterImage image, const ImagePDFPr
     if(params.as_mask && !image.alpha.empty()) {
         RETERR(MaskAndAlpha);
     }
+    const int32_t image_key[] = {image.md.w,
+                                 image.md.h,
+                                 image.md.pixel_depth,
+                                 image.md.alpha_depth,
+                                 (int32_t)image.md.cs,
+                                 (int32_t)image.md.compression,
+                                 (int32_t)params.interp,
+                                 (int32_t)params.as_mask};
+    auto content_hash = hash_bytes(image.pixel_data());
+    content_hash = hash_bytes(image.alpha, content_hash);
+    content_hash = hash_bytes(image.icc_profile, content_hash);
+    content_hash = hash_bytes(
+        std::string_view{(const char *)image_key, sizeof(image_key)}, content_hash);
+    const auto cached = image_dedup.find(content_hash);
+    if(cached != image_dedup.end()) {
+        return cached->second;
+    }
     if(!image.alpha.empty()) {
         ERC(imobj,
             add_image_object(image.md.w,
@@ -1017,26 +1594,21 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image(RasterImage image, const ImagePDFPr
                              image.md.compression));
         smask_id = image_info.at(imobj.id).obj;
     }
+    ImageColorspaceType colorspace = image.md.cs;
     if(!image.icc_profile.empty()) {
-        auto icc_id = store_icc_profile(image.icc_profile, num_channels_for(image.md.cs));
-        return add_image_object(image.md.w,
-                                image.md.h,
-                                image.md.pixel_depth,
-                                icc_id,
-                                smask_id,
-                                params,
-                                image.pixels,
-                                image.md.compression);
-    } else {
-        return add_image_object(image.md.w,
-                                image.md.h,
-                                image.md.pixel_depth,
-                                image.md.cs,
-                                smask_id,
-                                params,
-                                image.pixels,
-                                image.md.compression);
-    }
+        colorspace = store_icc_profile(image.icc_profile, num_channels_for(image.md.cs));
+    }
+    ERC(image_id,
+        add_image_object(image.md.w,
+                         image.md.h,
+                         image.md.pixel_depth,
+                         colorspace,
+                         smask_id,
+                         params,
+                         image.pixel_data(),
+                         image.md.compression));
+    image_dedup.emplace(content_hash, image_id);
+    return image_id;
 }
 
 rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
@@ -1047,21 +1619,15 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
                                                     const ImagePDFProperties &params,
                                                     std::string_view original_bytes,
                                                     CapyPDF_Compression compression) {
+    // Compressible pixel data is not deflated here but at write time,
+    // where the worker pool handles it. The ingest loop only pays for
+    // the sampling check, so the next image can be loaded while this
+    // one is still unencoded. Dense data such as photographic noise
+    // does not shrink, store it as is and skip the deflate work
+    // entirely.
+    const bool defer_deflate =
+        compression == CAPY_COMPRESSION_NONE && worth_compressing(original_bytes);
     std::string buf;
-    std::string compression_buffer;
-    std::string_view compressed_bytes;
-    switch(compression) {
-    case CAPY_COMPRESSION_NONE: {
-        ERC(trial_compressed, flate_compress(original_bytes));
-        compression_buffer = std::move(trial_compressed);
-        compressed_bytes = compression_buffer;
-        break;
-    }
-    case CAPY_COMPRESSION_DEFLATE:
-        compressed_bytes = original_bytes;
-        break;
-    }
-
     auto app = std::back_inserter(buf);
     std::format_to(app,
                    R"(<<
@@ -1070,13 +1636,16 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
   /Width {}
   /Height {}
   /BitsPerComponent {}
-  /Length {}
-  /Filter /FlateDecode
 )",
                    w,
                    h,
-                   bits_per_component,
-                   compressed_bytes.size());
+                   bits_per_component);
+    if(!defer_deflate) {
+        std::format_to(app, "  /Length {}\n", original_bytes.size());
+        if(compression == CAPY_COMPRESSION_DEFLATE) {
+            buf += "  /Filter /FlateDecode\n";
+        }
+    }
 
     // Auto means don't specify the interpolation
     if(params.interp == CAPY_INTERPOLATION_PIXELATED) {
@@ -1102,11 +1671,14 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
     if(smask_id) {
         std::format_to(app, "  /SMask {} 0 R\n", smask_id.value());
     }
-    buf += ">>\n";
     int32_t im_id;
-    if(compression == CAPY_COMPRESSION_NONE) {
-        im_id = add_object(FullPDFObject{std::move(buf), std::move(compression_buffer)});
+    if(defer_deflate) {
+        // The dictionary is left unclosed, the writer fills in the
+        // filter and length once the stream has been compressed.
+        im_id = add_object(DeflatePDFObject{
+            std::move(buf), std::string{original_bytes}, CAPY_STREAM_CLASS_IMAGE});
     } else {
+        buf += ">>\n";
         // FIXME. Makes a copy. Fix to grab original data instead.
         im_id = add_object(FullPDFObject{std::move(buf), std::string{original_bytes}});
     }
@@ -1116,6 +1688,14 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
 
 rvoe<CapyPDF_ImageId> PdfDocument::embed_jpg(jpg_image jpg,
                                              CapyPDF_Image_Interpolation interpolate) {
+    const int32_t interp_key = (int32_t)interpolate;
+    auto content_hash = hash_bytes(jpg.file_contents);
+    content_hash =
+        hash_bytes(std::string_view{(const char *)&interp_key, sizeof(interp_key)}, content_hash);
+    const auto cached = image_dedup.find(content_hash);
+    if(cached != image_dedup.end()) {
+        return cached->second;
+    }
     std::string buf;
     std::format_to(std::back_inserter(buf),
                    R"(<<
@@ -1142,11 +1722,76 @@ rvoe<CapyPDF_ImageId> PdfDocument::embed_jpg(jpg_image jpg,
 
     auto im_id = add_object(FullPDFObject{std::move(buf), std::move(jpg.file_contents)});
     image_info.emplace_back(ImageInfo{{jpg.w, jpg.h}, im_id});
-    return CapyPDF_ImageId{(int32_t)image_info.size() - 1};
+    const CapyPDF_ImageId image_id{(int32_t)image_info.size() - 1};
+    image_dedup.emplace(content_hash, image_id);
+    return image_id;
+}
+
+rvoe<CapyPDF_ImageId> PdfDocument::embed_png(png_raw_image png,
+                                             CapyPDF_Image_Interpolation interpolate) {
+    const int32_t png_key[] = {(int32_t)interpolate, png.bit_depth, png.num_channels};
+    auto content_hash = hash_bytes(png.idat);
+    content_hash = hash_bytes(png.palette, content_hash);
+    content_hash =
+        hash_bytes(std::string_view{(const char *)png_key, sizeof(png_key)}, content_hash);
+    const auto cached = image_dedup.find(content_hash);
+    if(cached != image_dedup.end()) {
+        return cached->second;
+    }
+    std::string buf;
+    auto app = std::back_inserter(buf);
+    // The IDAT data is already a zlib stream, it only needs the PNG
+    // predictor declared so readers undo the scanline filters.
+    std::format_to(app,
+                   R"(<<
+  /Type /XObject
+  /Subtype /Image
+  /Width {}
+  /Height {}
+  /BitsPerComponent {}
+  /Length {}
+  /Filter /FlateDecode
+  /DecodeParms <<
+    /Predictor 15
+    /Colors {}
+    /BitsPerComponent {}
+    /Columns {}
+  >>
+)",
+                   png.w,
+                   png.h,
+                   png.bit_depth,
+                   png.idat.size(),
+                   png.num_channels,
+                   png.bit_depth,
+                   png.w);
+    if(png.indexed) {
+        std::format_to(app, "  /ColorSpace [ /Indexed /DeviceRGB {} <", png.palette.size() / 3 - 1);
+        for(const auto c : png.palette) {
+            std::format_to(app, "{:02X}", (unsigned char)c);
+        }
+        buf += "> ]\n";
+    } else {
+        std::format_to(app,
+                       "  /ColorSpace {}\n",
+                       colorspace_names.at(png.num_channels == 1 ? CAPY_IMAGE_CS_GRAY
+                                                                 : CAPY_IMAGE_CS_RGB));
+    }
+    // Auto means don't specify the interpolation
+    if(interpolate == CAPY_INTERPOLATION_PIXELATED) {
+        buf += "  /Interpolate false\n";
+    } else if(interpolate == CAPY_INTERPOLATION_SMOOTH) {
+        buf += "  /Interpolate true\n";
+    }
+    buf += ">>\n";
+    auto im_id = add_object(FullPDFObject{std::move(buf), std::move(png.idat)});
+    image_info.emplace_back(ImageInfo{{png.w, png.h}, im_id});
+    const CapyPDF_ImageId image_id{(int32_t)image_info.size() - 1};
+    image_dedup.emplace(content_hash, image_id);
+    return image_id;
 }
 
 rvoe<CapyPDF_GraphicsStateId> PdfDocument::add_graphics_state(const GraphicsState &state) {
-    const int32_t id = (int32_t)document_objects.size();
     std::string buf{
         R"(<<
   /Type /ExtGState
@@ -1199,8 +1844,15 @@ rvoe<CapyPDF_GraphicsStateId> PdfDocument::add_graphics_state(const GraphicsStat
         std::format_to(resource_appender, "  /TK {}\n", *state.TK ? "true" : "false");
     }
     buf += ">>\n";
-    add_object(FullPDFObject{std::move(buf), {}});
-    return CapyPDF_GraphicsStateId{id};
+    const auto content_hash = hash_bytes(buf);
+    const auto cached = graphics_state_dedup.find(content_hash);
+    if(cached != graphics_state_dedup.end()) {
+        return cached->second;
+    }
+    const auto id = add_object(FullPDFObject{std::move(buf), {}});
+    const CapyPDF_GraphicsStateId gsid{id};
+    graphics_state_dedup.emplace(content_hash, gsid);
+    return gsid;
 }
 
 rvoe<CapyPDF_FunctionId> PdfDocument::add_function(const FunctionType2 &func) {
@@ -1432,14 +2084,39 @@ rvoe<CapyPDF_FormWidgetId> PdfDocument::create_form_checkbox(PdfBox loc,
 }
 
 rvoe<CapyPDF_EmbeddedFileId> PdfDocument::embed_file(const std::filesystem::path &fname) {
-    ERC(contents, load_file(fname));
-    std::string dict = std::format(R"(<<
+    ERC(mapping, MappedFile::map(fname));
+    // The embedded name is part of the filespec, so the same bytes under
+    // a different name must still become a new object.
+    const auto content_hash = hash_bytes(fname.filename().string(), hash_bytes(mapping.sv()));
+    const auto cached = embedded_file_dedup.find(content_hash);
+    if(cached != embedded_file_dedup.end()) {
+        return cached->second;
+    }
+    int32_t fileobj_id;
+    if(worth_compressing(mapping.sv())) {
+        // The file is deflated into the output in chunks at write
+        // time. The length object must directly follow the stream
+        // object, so allocate both numbers under the object lock.
+        std::lock_guard<std::mutex> lock(*object_mutex);
+        fileobj_id = (int32_t)document_objects.size();
+        std::string dict = std::format(R"(<<
+  /Type /EmbeddedFile
+  /Filter /FlateDecode
+  /Length {} 0 R
+>>)",
+                                       fileobj_id + 1);
+        document_objects.push_back(
+            DeflateMappedFilePDFObject{std::move(dict), std::move(mapping)});
+        document_objects.push_back(DelayedStreamLength{fileobj_id});
+    } else {
+        std::string dict = std::format(R"(<<
   /Type /EmbeddedFile
   /Length {}
 >>)",
-                                   contents.size());
-    auto fileobj_id = add_object(FullPDFObject{std::move(dict), std::move(contents)});
-    dict = std::format(R"(<<
+                                       mapping.sv().size());
+        fileobj_id = add_object(MappedFilePDFObject{std::move(dict), std::move(mapping)});
+    }
+    std::string dict = std::format(R"(<<
   /Type /Filespec
   /F {}
   /EF << /F {} 0 R >>
@@ -1449,13 +2126,29 @@ rvoe<CapyPDF_EmbeddedFileId> PdfDocument::embed_file(const std::filesystem::path
                        fileobj_id);
     auto filespec_id = add_object(FullPDFObject{std::move(dict), {}});
     embedded_files.emplace_back(EmbeddedFileObject{filespec_id, fileobj_id});
-    return CapyPDF_EmbeddedFileId{(int32_t)embedded_files.size() - 1};
+    const CapyPDF_EmbeddedFileId file_id{(int32_t)embedded_files.size() - 1};
+    embedded_file_dedup.emplace(content_hash, file_id);
+    return file_id;
 }
 
 rvoe<CapyPDF_AnnotationId> PdfDocument::create_annotation(const Annotation &a) {
     if(!a.rect) {
         RETERR(AnnotationMissingRect);
     }
+    if(auto *ua = std::get_if<UriAnnotation>(&a.sub)) {
+        // Links to the same target share one action object so a
+        // million identical links do not store a million copies.
+        const auto uri_hash = hash_bytes(ua->uri.sv());
+        if(uri_action_dedup.find(uri_hash) == uri_action_dedup.end()) {
+            auto action = std::format(R"(<<
+  /S /URI
+  /URI {}
+>>
+)",
+                                      pdfstring_quote(ua->uri.sv()));
+            uri_action_dedup.emplace(uri_hash, add_object(FullPDFObject{std::move(action), {}}));
+        }
+    }
     auto annot_id = (int32_t)annotations.size();
     auto obj_id = add_object(DelayedAnnotation{{annot_id}, a});
     annotations.push_back((int32_t)obj_id);
@@ -1513,13 +2206,14 @@ PdfDocument::add_transparency_group(PdfDrawContext &ctx, const TransparencyGroup
     }
     auto sc_var = ctx.serialize(ex);
     auto &d = std::get<SerializedXObject>(sc_var);
-    auto objid = add_object(FullPDFObject{std::move(d.dict), std::move(d.command_stream)});
+    auto objid = add_object(DeflatePDFObject{std::move(d.unclosed_dict), std::move(d.command_stream)});
     transparency_groups.push_back(objid);
     return CapyPDF_TransparencyGroupId{(int32_t)transparency_groups.size() - 1};
 }
 
 std::optional<double>
 PdfDocument::glyph_advance(CapyPDF_FontId fid, double pointsize, uint32_t codepoint) const {
+    std::lock_guard<std::mutex> lock(*font_mutex);
     FT_Face face = fonts.at(fid.id).fontdata.face.get();
     FT_Set_Char_Size(face, 0, (FT_F26Dot6)(pointsize * 64), 300, 300);
     if(FT_Load_Char(face, codepoint, FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP) != 0) {
@@ -1529,10 +2223,12 @@ PdfDocument::glyph_advance(CapyPDF_FontId fid, double pointsize, uint32_t codepo
     return (font_unit_advance / 64.0) / 300.0 * 72.0;
 }
 
-rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft, const std::filesystem::path &fname) {
-    ERC(fontdata, load_and_parse_truetype_font(fname));
+rvoe<CapyPDF_FontId>
+PdfDocument::load_font(FT_Library ft, const std::filesystem::path &fname, bool use_cid) {
+    ERC(fontdata, load_and_parse_truetype_font_cached(fname));
     TtfFont ttf{std::unique_ptr<FT_FaceRec_, FT_Error (*)(FT_Face)>{nullptr, guarded_face_close},
-                std::move(fontdata)};
+                std::move(fontdata),
+                fname};
     FT_Face face;
     auto error = FT_New_Face(ft, fname.string().c_str(), 0, &face);
     if(error) {
@@ -1570,7 +2266,7 @@ rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft, const std::filesystem
         RETERR(UnsupportedFormat);
     }
     auto font_source_id = fonts.size();
-    ERC(fss, FontSubsetter::construct(fname, face));
+    ERC(fss, FontSubsetter::construct(fname, face, use_cid));
     fonts.emplace_back(FontThingy{std::move(ttf), std::move(fss)});
 
     const int32_t subset_num = 0;
@@ -1580,8 +2276,15 @@ rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft, const std::filesystem
         CapyPDF_FontId{(int32_t)font_source_id}, subfont_data_obj, subset_num});
     auto subfont_cmap_obj =
         add_object(DelayedSubsetCMap{CapyPDF_FontId{(int32_t)font_source_id}, subset_num});
-    auto subfont_obj = add_object(DelayedSubsetFont{
-        CapyPDF_FontId{(int32_t)font_source_id}, subfont_descriptor_obj, subfont_cmap_obj});
+    int32_t subfont_descendant_obj = -1;
+    if(use_cid) {
+        subfont_descendant_obj = add_object(DelayedSubsetCIDFont{
+            CapyPDF_FontId{(int32_t)font_source_id}, subfont_descriptor_obj, subset_num});
+    }
+    auto subfont_obj = add_object(DelayedSubsetFont{CapyPDF_FontId{(int32_t)font_source_id},
+                                                    subfont_descriptor_obj,
+                                                    subfont_cmap_obj,
+                                                    subfont_descendant_obj});
     (void)subfont_obj;
     CapyPDF_FontId fid{(int32_t)fonts.size() - 1};
     font_objects.push_back(
@@ -8,6 +8,7 @@
 #include <pdfcommon.hpp>
 #include <fontsubsetter.hpp>
 #include <pdfcolorconverter.hpp>
+#include <utils.hpp>
 
 #include <string_view>
 #include <vector>
@@ -16,6 +17,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
+#include <mutex>
 #include <variant>
 
 // To avoid pulling all of LittleCMS in this file.
@@ -31,7 +33,11 @@ namespace capypdf {
 
 struct TtfFont {
     std::unique_ptr<FT_FaceRec_, FT_Error (*)(FT_Face)> face;
-    TrueTypeFontFile fontdata;
+    // Shared with the process-wide font cache, immutable.
+    std::shared_ptr<const TrueTypeFontFile> fontdata;
+    // Kept so clones can open their own face with their own
+    // FT_Library.
+    std::filesystem::path source_file;
 };
 
 struct PageOffsets {
@@ -106,6 +112,39 @@ struct FullPDFObject {
 struct DeflatePDFObject {
     std::string unclosed_dictionary;
     std::string stream;
+    // Picks the compression level and the statistics bucket when the
+    // stream is deflated at write time.
+    CapyPDF_Stream_Class stream_class = CAPY_STREAM_CLASS_CONTENT;
+};
+
+// An object whose stream is a memory mapped file that is written out
+// verbatim, so the bytes are never copied to the heap.
+struct MappedFilePDFObject {
+    std::string dictionary;
+    MappedFile file;
+};
+
+// An object whose stream is a memory mapped file that is deflated
+// straight into the output one chunk at a time at write time, so peak
+// memory use does not depend on the attachment size. The compressed
+// size is only known once the data has been written, so the stream
+// dictionary references a separate length object that follows it.
+struct DeflateMappedFilePDFObject {
+    std::string dictionary;
+    MappedFile file;
+};
+
+// The length object of a chunk-deflated stream, filled in by the
+// writer after the stream body has gone out.
+struct DelayedStreamLength {
+    int32_t stream_obj;
+};
+
+// An object that has already been written to the output file
+// in streaming mode. Only its offset needs to be remembered
+// for the cross-reference table.
+struct WrittenObject {
+    int64_t offset;
 };
 
 struct DelayedSubsetFontData {
@@ -128,6 +167,15 @@ struct DelayedSubsetFont {
     CapyPDF_FontId fid;
     int32_t subfont_descriptor_obj;
     int32_t subfont_cmap_obj;
+    // Only used by CID-keyed fonts, whose top level dictionary points to a
+    // descendant CIDFontType2 dictionary instead of a descriptor.
+    int32_t subfont_descendant_obj = -1;
+};
+
+struct DelayedSubsetCIDFont {
+    CapyPDF_FontId fid;
+    int32_t subfont_descriptor_obj;
+    int32_t subset_id;
 };
 
 struct DelayedPages {};
@@ -144,7 +192,9 @@ struct DelayedPage {
 
 struct SubsetGlyph {
     FontSubset ss;
-    uint8_t glyph_id;
+    // CID-keyed subsets have two byte character codes, so this does not
+    // fit in a uint8_t.
+    uint32_t glyph_id;
 };
 
 struct FontThingy {
@@ -164,6 +214,24 @@ struct IccInfo {
     int32_t num_channels;
 };
 
+// Deflate levels per stream class on the zlib 1-9 scale.
+struct CompressionPolicy {
+    int32_t content_level = 9;
+    int32_t image_level = 9;
+    int32_t font_level = 9;
+
+    int32_t level_for(CapyPDF_Stream_Class stream_class) const {
+        switch(stream_class) {
+        case CAPY_STREAM_CLASS_IMAGE:
+            return image_level;
+        case CAPY_STREAM_CLASS_FONT:
+            return font_level;
+        default:
+            return content_level;
+        }
+    }
+};
+
 struct PdfGenerationData {
     PdfGenerationData() { default_page_properties.mediabox = PdfRectangle::a4(); }
 
@@ -178,8 +246,52 @@ struct PdfGenerationData {
     std::optional<CapyPDF_PDFX_Type> xtype;
     std::string intent_condition_identifier;
     bool compress_streams = false;
+    // Write finished objects to the output file immediately instead of
+    // buffering the entire document in memory until the end.
+    bool streamed_writes = false;
+    // Pack non-stream objects into compressed object streams and write
+    // a PDF 1.5 cross reference stream instead of a classic xref table.
+    bool use_object_streams = false;
+    // Maximum number of decimals written for content stream coordinates.
+    int32_t coordinate_precision = 6;
+    // Number of threads used when deflating large streams.
+    // One means doing everything in the calling thread,
+    // zero means using all hardware threads.
+    uint32_t num_threads = 1;
+    // If set, append the output to this previously generated file as an
+    // incremental update instead of writing a full document.
+    std::filesystem::path incremental_base;
+    // Number of object ids reserved for other shards of a sharded
+    // document. Object numbering starts after the reserved block,
+    // which becomes free entries in the cross reference table, so
+    // shard outputs can be merged without renumbering anything.
+    int32_t shard_object_offset = 0;
+    CompressionPolicy compression;
+};
+
+// Data extracted from the file an incremental update gets appended to.
+struct IncrementalBaseInfo {
+    std::string contents;
+    // Offsets of the base objects, including the free slot zero.
+    // Free entries other than slot zero have offset zero.
+    std::vector<uint64_t> object_offsets;
+    int64_t xref_offset;
+    int32_t pages_object;
+    std::vector<int32_t> page_kids;
+    int32_t page_count;
+    // Zero when the trailer has no /Info entry.
+    int32_t info_object;
 };
 
+rvoe<IncrementalBaseInfo> load_incremental_base(const std::filesystem::path &fname);
+
+// Concatenates documents generated with disjoint object number ranges
+// (see shard_object_offset) into one file. Object bytes are copied
+// verbatim without recompressing any streams, only the page tree
+// roots, catalog, cross reference table and trailer are regenerated.
+rvoe<NoReturnValue> merge_shards(const std::vector<std::filesystem::path> &shard_files,
+                                 const std::filesystem::path &ofilename);
+
 struct Outline {
     u8string title;
     std::optional<Destination> dest;
@@ -291,10 +403,15 @@ struct StructureUsage {
 typedef std::variant<DummyIndexZero,
                      FullPDFObject,
                      DeflatePDFObject,
+                     MappedFilePDFObject,
+                     DeflateMappedFilePDFObject,
+                     DelayedStreamLength,
+                     WrittenObject,
                      DelayedSubsetFontData,
                      DelayedSubsetFontDescriptor,
                      DelayedSubsetCMap,
                      DelayedSubsetFont,
+                     DelayedSubsetCIDFont,
                      DelayedPages,
                      DelayedPage,
                      DelayedCheckboxWidgetAnnotation, // FIXME, convert to hold all widgets
@@ -313,6 +430,13 @@ class PdfDocument {
 public:
     static rvoe<PdfDocument> construct(const PdfGenerationData &d, PdfColorConverter cm);
 
+    // A deep copy of this document that shares the parsed font data.
+    // Used to stamp out many documents from one prepared template
+    // without redoing resource setup. The copy opens its own FreeType
+    // faces from the given library so it can be used from a different
+    // thread than the original.
+    rvoe<PdfDocument> clone(PdfColorConverter new_cm, FT_Library ft) const;
+
     PdfDocument(PdfDocument &&o) = default;
 
     friend class PdfGen;
@@ -320,15 +444,17 @@ public:
     friend class PdfWriter;
 
     // Pages
-    rvoe<NoReturnValue> add_page(std::string resource_dict,
-                                 std::string unclosed_object_dict,
-                                 std::string command_stream,
-                                 const PageProperties &custom_props,
-                                 const std::unordered_set<CapyPDF_FormWidgetId> &form_widgets,
-                                 const std::unordered_set<CapyPDF_AnnotationId> &annots,
-                                 const std::vector<CapyPDF_StructureItemId> &structs,
-                                 const std::optional<Transition> &transition,
-                                 const std::vector<SubPageNavigation> &subnav);
+    // Safe to call from multiple threads at once. Returns the index
+    // of the added page.
+    rvoe<int32_t> add_page(std::string resource_dict,
+                           std::string unclosed_object_dict,
+                           std::string command_stream,
+                           const PageProperties &custom_props,
+                           const std::unordered_set<CapyPDF_FormWidgetId> &form_widgets,
+                           const std::unordered_set<CapyPDF_AnnotationId> &annots,
+                           const std::vector<CapyPDF_StructureItemId> &structs,
+                           const std::optional<Transition> &transition,
+                           const std::vector<SubPageNavigation> &subnav);
 
     // Form XObjects
     void add_form_xobject(std::string xobj_data, std::string xobj_stream);
@@ -340,7 +466,8 @@ public:
     rvoe<CapyPDF_IccColorSpaceId> load_icc_file(const std::filesystem::path &fname);
 
     // Fonts
-    rvoe<CapyPDF_FontId> load_font(FT_Library ft, const std::filesystem::path &fname);
+    rvoe<CapyPDF_FontId>
+    load_font(FT_Library ft, const std::filesystem::path &fname, bool use_cid = false);
     rvoe<SubsetGlyph> get_subset_glyph(CapyPDF_FontId fid,
                                        uint32_t codepoint,
                                        const std::optional<uint32_t> glyph_id);
@@ -354,6 +481,7 @@ public:
     rvoe<CapyPDF_ImageId> add_mask_image(RasterImage image, const ImagePDFProperties &params);
     rvoe<CapyPDF_ImageId> add_image(RasterImage image, const ImagePDFProperties &params);
     rvoe<CapyPDF_ImageId> embed_jpg(jpg_image jpg, CapyPDF_Image_Interpolation interpolate);
+    rvoe<CapyPDF_ImageId> embed_png(png_raw_image png, CapyPDF_Image_Interpolation interpolate);
 
     // Graphics states
     rvoe<CapyPDF_GraphicsStateId> add_graphics_state(const GraphicsState &state);
@@ -404,6 +532,7 @@ public:
     glyph_advance(CapyPDF_FontId fid, double pointsize, uint32_t codepoint) const;
 
     rvoe<int32_t> create_structure_parent_tree();
+    void flush_parent_tree_leaf(bool force);
 
     rvoe<CapyPDF_RoleId> add_rolemap_entry(std::string name, CapyPDF_StructureType builtin_type);
 
@@ -446,6 +575,10 @@ private:
     rvoe<NoReturnValue> generate_info_object();
     int32_t create_page_group();
     void pad_subset_fonts();
+    // Groups pages under intermediate /Pages nodes so viewers do not
+    // have to scan one giant kids array. Called at write time when all
+    // pages are known.
+    void build_page_tree();
     void pad_subset_until_space(std::vector<TTGlyphs> &subset_glyphs);
 
     rvoe<NoReturnValue> validate_format(const RasterImage &ri) const;
@@ -453,6 +586,17 @@ private:
     PdfGenerationData opts;
     PdfColorConverter cm;
     std::vector<ObjectType> document_objects;
+    // Pages may be built in draw contexts and added from multiple
+    // threads at once. These guard the state such pipelines share:
+    // object number allocation, page finalization and the font subset
+    // bookkeeping mutated while text commands are serialized. Creating
+    // resources (fonts, images, patterns and so on) must still happen
+    // before the parallel phase or be synchronized by the caller. Held
+    // in unique_ptrs because mutexes are not movable but PdfDocument
+    // is.
+    std::unique_ptr<std::mutex> object_mutex;
+    std::unique_ptr<std::mutex> page_mutex;
+    std::unique_ptr<std::mutex> font_mutex;
     std::vector<PageOffsets> pages; // Refers to object num.
     std::vector<ImageInfo> image_info;
     std::unordered_map<CapyPDF_Builtin_Fonts, CapyPDF_FontId> builtin_fonts;
@@ -469,19 +613,56 @@ private:
     std::vector<int32_t> ocg_items;
     std::vector<int32_t> transparency_groups;
     std::vector<RolemapEnty> rolemap;
+    // Content hash -> previously created resource, so adding the same
+    // image, profile or state on every page reuses one object.
+    std::unordered_map<uint64_t, CapyPDF_ImageId> image_dedup;
+    std::unordered_map<uint64_t, CapyPDF_IccColorSpaceId> icc_dedup;
+    std::unordered_map<uint64_t, CapyPDF_EmbeddedFileId> embedded_file_dedup;
+    std::unordered_map<uint64_t, CapyPDF_GraphicsStateId> graphics_state_dedup;
+    // URI hash -> object number of the shared link action dictionary.
+    std::unordered_map<uint64_t, int32_t> uri_action_dedup;
+    // Resource dictionary hash -> object number, so pages with the
+    // same resource set share one /Resources object. Guarded by
+    // page_mutex.
+    std::unordered_map<uint64_t, int32_t> resource_dict_dedup;
     // A form widget can be used on one and only one page.
     std::unordered_map<CapyPDF_FormWidgetId, int32_t> form_use;
     std::unordered_map<CapyPDF_AnnotationId, int32_t> annotation_use;
     std::unordered_map<CapyPDF_StructureItemId, StructureUsage> structure_use;
     std::vector<std::vector<CapyPDF_StructureItemId>>
         structure_parent_tree_items; // FIXME should be a variant of some sort?
+    // Object numbers of finished /ParentTree leaf nodes. Leaves are
+    // emitted as soon as they fill up so the number tree is built
+    // incrementally during generation instead of in one go at write
+    // time.
+    std::vector<int32_t> parent_tree_leaves;
     std::optional<CapyPDF_IccColorSpaceId> output_profile;
     std::optional<int32_t> output_intent_object;
     std::optional<int32_t> structure_root_object;
     std::optional<int32_t> structure_parent_tree_object;
     int32_t pages_object;
     int32_t page_group_object;
+    // Filled in by build_page_tree. The parent node of every page and
+    // the kids of the root node when intermediate nodes are in use.
+    std::vector<int32_t> page_parents;
+    std::vector<int32_t> page_tree_root_kids;
+    // Set when this document is an incremental update to an existing file.
+    std::optional<IncrementalBaseInfo> incremental_base;
+    // Set when streamed writes are enabled. Finished objects are handed
+    // to the writer as soon as they are added.
+    PdfWriter *stream_writer = nullptr;
     bool write_attempted = false;
+    GenerationStats stats;
+    // Invoked after each timed phase when set, for feeding spans into
+    // an external profiler.
+    CapyPDF_Trace_Callback trace_cb = nullptr;
+    void *trace_ctx = nullptr;
+
+    void trace_span(const char *phase, double seconds) {
+        if(trace_cb) {
+            trace_cb(phase, seconds, trace_ctx);
+        }
+    }
 };
 
 } // namespace capypdf
@@ -9,13 +9,28 @@
 #include FT_IMAGE_H
 #include <utils.hpp>
 #include <format>
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <mutex>
 #include <cassert>
 #include <memory>
 
 namespace capypdf {
 
+namespace {
+
+// Resource usage is tracked in unordered sets. Emit them in sorted
+// order so pages with the same resources serialize to byte-identical
+// dictionaries, which add_page then shares as a single object.
+std::vector<int32_t> sorted_keys(const std::unordered_set<int32_t> &s) {
+    std::vector<int32_t> v(s.begin(), s.end());
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+} // namespace
+
 GstatePopper::~GstatePopper() { ctx->cmd_Q(); }
 
 PdfDrawContext::PdfDrawContext(
@@ -27,21 +42,21 @@ PdfDrawContext::~PdfDrawContext() {}
 DCSerialization PdfDrawContext::serialize(const TransparencyGroupExtra *trinfo) {
     auto resource_dict = build_resource_dict();
     if(context_type == CAPY_DC_FORM_XOBJECT) {
+        // The dictionary is left unclosed so the contents can be stored
+        // compressed. A form xobject is recorded and deflated only once
+        // no matter how many pages stamp it with cmd_Do.
         std::string dict = std::format(
             R"(<<
   /Type /XObject
   /Subtype /Form
   /BBox [ {:f} {:f} {:f} {:f} ]
   /Resources {}
-  /Length {}
->>
 )",
             0.0,
             0.0,
             w,
             h,
-            resource_dict,
-            commands.size());
+            resource_dict);
         return SerializedXObject{std::move(dict), commands};
     } else if(context_type == CAPY_DC_TRANSPARENCY_GROUP) {
         std::string dict = R"(<<
@@ -64,11 +79,8 @@ DCSerialization PdfDrawContext::serialize(const TransparencyGroupExtra *trinfo)
         std::format_to(app,
                        R"(  >>
   /Resources {}
-  /Length {}
->>
 )",
-                       resource_dict,
-                       commands.size());
+                       resource_dict);
         return SerializedXObject{std::move(dict), commands};
     } else {
         SerializedBasicContext sc;
@@ -107,18 +119,23 @@ std::string PdfDrawContext::build_resource_dict() {
     if(!used_images.empty() || !used_form_xobjects.empty() || !used_trgroups.empty()) {
         resources += "  /XObject <<\n";
         if(!used_images.empty()) {
-            for(const auto &i : used_images) {
+            for(const auto &i : sorted_keys(used_images)) {
                 std::format_to(resource_appender, "    /Image{} {} 0 R\n", i, i);
             }
         }
         if(!used_form_xobjects.empty()) {
-            for(const auto &fx : used_form_xobjects) {
+            for(const auto &fx : sorted_keys(used_form_xobjects)) {
                 std::format_to(resource_appender, "    /FXO{} {} 0 R\n", fx, fx);
             }
         }
         if(!used_trgroups.empty()) {
+            std::vector<int32_t> tgnums;
+            tgnums.reserve(used_trgroups.size());
             for(const auto &tg : used_trgroups) {
-                auto objnum = doc->transparency_groups.at(tg.id);
+                tgnums.push_back(doc->transparency_groups.at(tg.id));
+            }
+            std::sort(tgnums.begin(), tgnums.end());
+            for(const auto &objnum : tgnums) {
                 std::format_to(resource_appender, "    /TG{} {} 0 R\n", objnum, objnum);
             }
         }
@@ -126,10 +143,14 @@ std::string PdfDrawContext::build_resource_dict() {
     }
     if(!used_fonts.empty() || !used_subset_fonts.empty()) {
         resources += "  /Font <<\n";
-        for(const auto &i : used_fonts) {
+        for(const auto &i : sorted_keys(used_fonts)) {
             std::format_to(resource_appender, "    /Font{} {} 0 R\n", i, i);
         }
-        for(const auto &i : used_subset_fonts) {
+        std::vector<FontSubset> subsets(used_subset_fonts.begin(), used_subset_fonts.end());
+        std::sort(subsets.begin(), subsets.end(), [](const FontSubset &a, const FontSubset &b) {
+            return a.fid.id != b.fid.id ? a.fid.id < b.fid.id : a.subset_id < b.subset_id;
+        });
+        for(const auto &i : subsets) {
             const auto &bob = doc->font_objects.at(i.fid.id);
             std::format_to(resource_appender,
                            "    /SFont{}-{} {} 0 R\n",
@@ -144,36 +165,41 @@ std::string PdfDrawContext::build_resource_dict() {
         if(uses_all_colorspace) {
             std::format_to(resource_appender, "    /All {} 0 R\n", doc->separation_objects.at(0));
         }
-        for(const auto &i : used_colorspaces) {
+        for(const auto &i : sorted_keys(used_colorspaces)) {
             std::format_to(resource_appender, "    /CSpace{} {} 0 R\n", i, i);
         }
         resources += "  >>\n";
     }
     if(!used_gstates.empty()) {
         resources += "  /ExtGState <<\n";
-        for(const auto &s : used_gstates) {
+        for(const auto &s : sorted_keys(used_gstates)) {
             std::format_to(resource_appender, "    /GS{} {} 0 R \n", s, s);
         }
         resources += "  >>\n";
     }
     if(!used_shadings.empty()) {
         resources += "  /Shading <<\n";
-        for(const auto &s : used_shadings) {
+        for(const auto &s : sorted_keys(used_shadings)) {
             std::format_to(resource_appender, "    /SH{} {} 0 R\n", s, s);
         }
         resources += "  >>\n";
     }
     if(!used_patterns.empty()) {
         resources += "  /Pattern <<\n";
-        for(const auto &s : used_patterns) {
+        for(const auto &s : sorted_keys(used_patterns)) {
             std::format_to(resource_appender, "    /Pattern-{} {} 0 R\n", s, s);
         }
         resources += "  >>\n";
     }
     if(!used_ocgs.empty()) {
         resources += "  /Properties <<\n";
+        std::vector<int32_t> ocgnums;
+        ocgnums.reserve(used_ocgs.size());
         for(const auto &ocg : used_ocgs) {
-            auto objnum = doc->ocg_object_number(ocg);
+            ocgnums.push_back(doc->ocg_object_number(ocg));
+        }
+        std::sort(ocgnums.begin(), ocgnums.end());
+        for(const auto &objnum : ocgnums) {
             std::format_to(resource_appender, "    /oc{} {} 0 R\n", objnum, objnum);
         }
         resources += "  >>\n";
@@ -288,15 +314,13 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_BMC(std::string_view tag) {
 
 rvoe<NoReturnValue>
 PdfDrawContext::cmd_c(double x1, double y1, double x2, double y2, double x3, double y3) {
-    std::format_to(
-        cmd_appender, "{}{:f} {:f} {:f} {:f} {:f} {:f} c\n", ind, x1, y1, x2, y2, x3, y3);
+    append_coord_cmd(commands, ind, coord_precision(), "c", x1, y1, x2, y2, x3, y3);
     RETOK;
 }
 
 rvoe<NoReturnValue>
 PdfDrawContext::cmd_cm(double m1, double m2, double m3, double m4, double m5, double m6) {
-    std::format_to(
-        cmd_appender, "{}{:f} {:f} {:f} {:f} {:f} {:f} cm\n", ind, m1, m2, m3, m4, m5, m6);
+    append_coord_cmd(commands, ind, coord_precision(), "cm", m1, m2, m3, m4, m5, m6);
     RETOK;
 }
 
@@ -323,7 +347,8 @@ PdfDrawContext::cmd_d(double *dash_array, size_t dash_array_length, double phase
     commands += ind;
     commands += "[ ";
     for(size_t i = 0; i < dash_array_length; ++i) {
-        std::format_to(cmd_appender, "{:f} ", dash_array[i]);
+        append_coord(commands, dash_array[i], coord_precision());
+        commands += ' ';
     }
     std::format_to(cmd_appender, " ] {} d\n", phase);
     RETOK;
@@ -373,11 +398,11 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_fstar() {
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_G(LimitDouble gray) {
-    return serialize_G(cmd_appender, ind, gray);
+    return serialize_G(commands, ind, gray);
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_g(LimitDouble gray) {
-    return serialize_g(cmd_appender, ind, gray);
+    return serialize_g(commands, ind, gray);
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_gs(CapyPDF_GraphicsStateId gid) {
@@ -397,7 +422,7 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_i(double flatness) {
     if(flatness < 0 || flatness > 100) {
         RETERR(InvalidFlatness);
     }
-    std::format_to(cmd_appender, "{}{:f} i\n", ind, flatness);
+    append_coord_cmd(commands, ind, coord_precision(), "i", flatness);
     RETOK;
 }
 
@@ -415,26 +440,117 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_J(CapyPDF_Line_Cap cap_style) {
 
 rvoe<NoReturnValue>
 PdfDrawContext::cmd_K(LimitDouble c, LimitDouble m, LimitDouble y, LimitDouble k) {
-    return serialize_K(cmd_appender, ind, c, m, y, k);
+    return serialize_K(commands, ind, c, m, y, k);
 }
 
 rvoe<NoReturnValue>
 PdfDrawContext::cmd_k(LimitDouble c, LimitDouble m, LimitDouble y, LimitDouble k) {
-    return serialize_k(cmd_appender, ind, c, m, y, k);
+    return serialize_k(commands, ind, c, m, y, k);
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_l(double x, double y) {
-    std::format_to(cmd_appender, "{}{:f} {:f} l\n", ind, x, y);
+    append_coord_cmd(commands, ind, coord_precision(), "l", x, y);
+    RETOK;
+}
+
+rvoe<NoReturnValue> PdfDrawContext::draw_polyline(const double *points, size_t num_points) {
+    if(num_points < 2) {
+        RETERR(ZeroLengthArray);
+    }
+    const int32_t prec = coord_precision();
+    append_coord_cmd(commands, ind, prec, "m", points[0], points[1]);
+    for(size_t i = 1; i < num_points; ++i) {
+        append_coord_cmd(commands, ind, prec, "l", points[2 * i], points[2 * i + 1]);
+    }
+    RETOK;
+}
+
+rvoe<NoReturnValue> PdfDrawContext::draw_path(const double *coords,
+                                              size_t num_coords,
+                                              const CapyPDF_Path_Operator *ops,
+                                              size_t num_ops) {
+    if(num_ops == 0) {
+        RETERR(ZeroLengthArray);
+    }
+    size_t ci = 0;
+    for(size_t i = 0; i < num_ops; ++i) {
+        switch(ops[i]) {
+        case CAPY_PATH_OP_MOVE:
+            if(ci + 2 > num_coords) {
+                RETERR(IndexOutOfBounds);
+            }
+            append_coord_cmd(commands, ind, coord_precision(), "m", coords[ci], coords[ci + 1]);
+            ci += 2;
+            break;
+        case CAPY_PATH_OP_LINE:
+            if(ci + 2 > num_coords) {
+                RETERR(IndexOutOfBounds);
+            }
+            append_coord_cmd(commands, ind, coord_precision(), "l", coords[ci], coords[ci + 1]);
+            ci += 2;
+            break;
+        case CAPY_PATH_OP_CURVE:
+            if(ci + 6 > num_coords) {
+                RETERR(IndexOutOfBounds);
+            }
+            append_coord_cmd(commands,
+                             ind,
+                             coord_precision(),
+                             "c",
+                             coords[ci],
+                             coords[ci + 1],
+                             coords[ci + 2],
+                             coords[ci + 3],
+                             coords[ci + 4],
+                             coords[ci + 5]);
+            ci += 6;
+            break;
+        case CAPY_PATH_OP_CURVE_V:
+            if(ci + 4 > num_coords) {
+                RETERR(IndexOutOfBounds);
+            }
+            append_coord_cmd(commands,
+                             ind,
+                             coord_precision(),
+                             "v",
+                             coords[ci],
+                             coords[ci + 1],
+                             coords[ci + 2],
+                             coords[ci + 3]);
+            ci += 4;
+            break;
+        case CAPY_PATH_OP_CURVE_Y:
+            if(ci + 4 > num_coords) {
+                RETERR(IndexOutOfBounds);
+            }
+            append_coord_cmd(commands,
+                             ind,
+                             coord_precision(),
+                             "y",
+                             coords[ci],
+                             coords[ci + 1],
+                             coords[ci + 2],
+                             coords[ci + 3]);
+            ci += 4;
+            break;
+        case CAPY_PATH_OP_CLOSE:
+            commands += ind;
+            commands += "h\n";
+            break;
+        default:
+            RETERR(BadEnum);
+        }
+    }
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_m(double x, double y) {
-    std::format_to(cmd_appender, "{}{:f} {:f} m\n", ind, x, y);
+    append_coord_cmd(commands, ind, coord_precision(), "m", x, y);
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_M(double miterlimit) {
-    std::format_to(cmd_appender, "{}{:f} M\n", ind, miterlimit);
+    append_coord_cmd(commands, ind, coord_precision(), "M", miterlimit);
     RETOK;
 }
 
@@ -459,16 +575,16 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_Q() {
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_re(double x, double y, double w, double h) {
-    std::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} re\n", ind, x, y, w, h);
+    append_coord_cmd(commands, ind, coord_precision(), "re", x, y, w, h);
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_RG(LimitDouble r, LimitDouble g, LimitDouble b) {
-    return serialize_RG(cmd_appender, ind, r, g, b);
+    return serialize_RG(commands, ind, r, g, b);
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_rg(LimitDouble r, LimitDouble g, LimitDouble b) {
-    return serialize_rg(cmd_appender, ind, r, g, b);
+    return serialize_rg(commands, ind, r, g, b);
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_ri(CapyPDF_Rendering_Intent ri) {
@@ -490,12 +606,12 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_S() {
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_SCN(double value) {
-    std::format_to(cmd_appender, "{}{:f} SCN\n", ind, value);
+    append_coord_cmd(commands, ind, coord_precision(), "SCN", value);
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_scn(double value) {
-    std::format_to(cmd_appender, "{}{:f} scn\n", ind, value);
+    append_coord_cmd(commands, ind, coord_precision(), "scn", value);
     RETOK;
 }
 
@@ -513,7 +629,7 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_Tr(CapyPDF_Text_Mode mode) {
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_v(double x2, double y2, double x3, double y3) {
-    std::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} v\n", ind, x2, y2, x3, y3);
+    append_coord_cmd(commands, ind, coord_precision(), "v", x2, y2, x3, y3);
     RETOK;
 }
 
@@ -521,7 +637,7 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_w(double w) {
     if(w < 0) {
         RETERR(NegativeLineWidth);
     }
-    std::format_to(cmd_appender, "{}{:f} w\n", ind, w);
+    append_coord_cmd(commands, ind, coord_precision(), "w", w);
     RETOK;
 }
 
@@ -538,59 +654,57 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_Wstar() {
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_y(double x1, double y1, double x3, double y3) {
-    std::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} y\n", ind, x1, y1, x3, y3);
+    append_coord_cmd(commands, ind, coord_precision(), "y", x1, y1, x3, y3);
     RETOK;
 }
 
-rvoe<NoReturnValue> PdfDrawContext::serialize_G(std::back_insert_iterator<std::string> &out,
-                                                std::string_view indent,
-                                                LimitDouble gray) const {
-    std::format_to(out, "{}{:f} G\n", indent, gray.v());
+rvoe<NoReturnValue>
+PdfDrawContext::serialize_G(std::string &out, std::string_view indent, LimitDouble gray) const {
+    append_coord_cmd(out, indent, coord_precision(), "G", gray.v());
     RETOK;
 }
 
-rvoe<NoReturnValue> PdfDrawContext::serialize_g(std::back_insert_iterator<std::string> &out,
-                                                std::string_view indent,
-                                                LimitDouble gray) const {
-    std::format_to(out, "{}{:f} g\n", indent, gray.v());
+rvoe<NoReturnValue>
+PdfDrawContext::serialize_g(std::string &out, std::string_view indent, LimitDouble gray) const {
+    append_coord_cmd(out, indent, coord_precision(), "g", gray.v());
     RETOK;
 }
 
-rvoe<NoReturnValue> PdfDrawContext::serialize_K(std::back_insert_iterator<std::string> &out,
+rvoe<NoReturnValue> PdfDrawContext::serialize_K(std::string &out,
                                                 std::string_view indent,
                                                 LimitDouble c,
                                                 LimitDouble m,
                                                 LimitDouble y,
                                                 LimitDouble k) const {
-    std::format_to(out, "{}{:f} {:f} {:f} {:f} K\n", ind, c.v(), m.v(), y.v(), k.v());
+    append_coord_cmd(out, indent, coord_precision(), "K", c.v(), m.v(), y.v(), k.v());
     RETOK;
 }
 
-rvoe<NoReturnValue> PdfDrawContext::serialize_k(std::back_insert_iterator<std::string> &out,
+rvoe<NoReturnValue> PdfDrawContext::serialize_k(std::string &out,
                                                 std::string_view indent,
                                                 LimitDouble c,
                                                 LimitDouble m,
                                                 LimitDouble y,
                                                 LimitDouble k) const {
-    std::format_to(out, "{}{:f} {:f} {:f} {:f} k\n", ind, c.v(), m.v(), y.v(), k.v());
+    append_coord_cmd(out, indent, coord_precision(), "k", c.v(), m.v(), y.v(), k.v());
     RETOK;
 }
 
-rvoe<NoReturnValue> PdfDrawContext::serialize_RG(std::back_insert_iterator<std::string> &out,
+rvoe<NoReturnValue> PdfDrawContext::serialize_RG(std::string &out,
                                                  std::string_view indent,
                                                  LimitDouble r,
                                                  LimitDouble g,
                                                  LimitDouble b) const {
-    std::format_to(out, "{}{:f} {:f} {:f} RG\n", indent, r.v(), g.v(), b.v());
+    append_coord_cmd(out, indent, coord_precision(), "RG", r.v(), g.v(), b.v());
     RETOK;
 }
 
-rvoe<NoReturnValue> PdfDrawContext::serialize_rg(std::back_insert_iterator<std::string> &out,
+rvoe<NoReturnValue> PdfDrawContext::serialize_rg(std::string &out,
                                                  std::string_view indent,
                                                  LimitDouble r,
                                                  LimitDouble g,
                                                  LimitDouble b) const {
-    std::format_to(out, "{}{:f} {:f} {:f} rg\n", indent, r.v(), g.v(), b.v());
+    append_coord_cmd(out, indent, coord_precision(), "rg", r.v(), g.v(), b.v());
     RETOK;
 }
 
@@ -687,7 +801,8 @@ rvoe<NoReturnValue> PdfDrawContext::set_color(const ICCColor &icc, bool stroke)
     std::format_to(
         cmd_appender, "{}/CSpace{} {}\n", ind, icc_info.object_num, stroke ? "CS" : "cs");
     for(const auto &i : icc.values) {
-        std::format_to(cmd_appender, "{:f} ", i);
+        append_coord(commands, i, coord_precision());
+        commands += ' ';
     }
     std::format_to(cmd_appender, "{}\n", stroke ? "SCN" : "scn");
     RETOK;
@@ -737,8 +852,7 @@ rvoe<NoReturnValue> PdfDrawContext::set_color(const LabColor &c, bool stroke) {
     } else {
         cmd_cs(csname);
     }
-    std::format_to(
-        cmd_appender, "{}{:f} {:f} {:f} {}\n", ind, c.l, c.a, c.b, stroke ? "SCN" : "scn");
+    append_coord_cmd(commands, ind, coord_precision(), stroke ? "SCN" : "scn", c.l, c.a, c.b);
     RETOK;
 }
 
@@ -803,7 +917,10 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_charsequence(const TextEvents &cha
             }
             current_font = current_subset_glyph.ss.fid;
             current_subset = current_subset_glyph.ss.subset_id;
-            std::format_to(app, "<{:02x}> ", current_subset_glyph.glyph_id);
+            // CID-keyed fonts use Identity-H, i.e. two byte character codes.
+            const auto code_width =
+                doc->fonts.at(current_subset_glyph.ss.fid.id).subsets.is_cid() ? 4 : 2;
+            std::format_to(app, "<{:0{}x}> ", current_subset_glyph.glyph_id, code_width);
         };
     for(const auto &e : charseq) {
         if(auto kval = std::get_if<KerningValue>(&e)) {
@@ -831,6 +948,19 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_charsequence(const TextEvents &cha
                 doc->get_subset_glyph(
                     current_font, glyphtextitem->source_text, glyphtextitem->glyph_id));
             appender_lambda(current_subset_glyph);
+        } else if(auto run = std::get_if<GlyphRun>(&e)) {
+            // Pre-shaped text. As long as the glyphs land in the same
+            // subset this produces a single coalesced TJ array.
+            for(size_t j = 0; j < run->glyph_ids.size(); ++j) {
+                ERC(current_subset_glyph,
+                    doc->get_subset_glyph(
+                        current_font, run->codepoints[j], run->glyph_ids[j]));
+                appender_lambda(current_subset_glyph);
+                is_first = false;
+                if(run->kerns[j] != 0) {
+                    std::format_to(app, "{} ", run->kerns[j]);
+                }
+            }
         } else {
             fprintf(stderr, "Not implemented yet.\n");
             std::abort();
@@ -853,6 +983,9 @@ rvoe<NoReturnValue> PdfDrawContext::utf8_to_kerned_chars(const u8string &text,
         RETERR(BuiltinFontNotSupported);
     }
 
+    // The face is shared with every other context using this font and
+    // FreeType is not thread safe.
+    std::lock_guard<std::mutex> font_lock(*doc->font_mutex);
     uint32_t previous_codepoint = -1;
     // Freetype does not support GPOS kerning because it is context-sensitive.
     // So this method might produce incorrect kerning. Users that need precision
@@ -904,12 +1037,12 @@ rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
         },
 
         [&](const Td_arg &td) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} {:f} Td\n", ind, td.tx, td.ty);
+            append_coord_cmd(serialisation, ind, coord_precision(), "Td", td.tx, td.ty);
             return NoReturnValue{};
         },
 
         [&](const TD_arg &tD) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} {:f} TD\n", ind, tD.tx, tD.ty);
+            append_coord_cmd(serialisation, ind, coord_precision(), "TD", tD.tx, tD.ty);
             return NoReturnValue{};
         },
 
@@ -938,20 +1071,13 @@ rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
         },
 
         [&](const TL_arg &tL) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} TL\n", ind, tL.leading);
+            append_coord_cmd(serialisation, ind, coord_precision(), "TL", tL.leading);
             return NoReturnValue{};
         },
 
         [&](const Tm_arg &tm) -> rvoe<NoReturnValue> {
-            std::format_to(app,
-                           "{}{:f} {:f} {:f} {:f} {:f} {:f} Tm\n",
-                           ind,
-                           tm.a,
-                           tm.b,
-                           tm.c,
-                           tm.d,
-                           tm.e,
-                           tm.f);
+            append_coord_cmd(
+                serialisation, ind, coord_precision(), "Tm", tm.a, tm.b, tm.c, tm.d, tm.e, tm.f);
             return NoReturnValue{};
         },
 
@@ -961,17 +1087,17 @@ rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
         },
 
         [&](const Ts_arg &ts) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} Ts\n", ind, ts.rise);
+            append_coord_cmd(serialisation, ind, coord_precision(), "Ts", ts.rise);
             return NoReturnValue{};
         },
 
         [&](const Tw_arg &tw) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} Tw\n", ind, tw.width);
+            append_coord_cmd(serialisation, ind, coord_precision(), "Tw", tw.width);
             return NoReturnValue{};
         },
 
         [&](const Tz_arg &tz) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} Tz\n", ind, tz.scaling);
+            append_coord_cmd(serialisation, ind, coord_precision(), "Tz", tz.scaling);
             return NoReturnValue{};
         },
 
@@ -1003,11 +1129,11 @@ rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
 
         [&](const Stroke_arg &sarg) -> rvoe<NoReturnValue> {
             if(auto rgb = std::get_if<DeviceRGBColor>(&sarg.c)) {
-                ERCV(serialize_RG(app, ind, rgb->r, rgb->g, rgb->b));
+                ERCV(serialize_RG(serialisation, ind, rgb->r, rgb->g, rgb->b));
             } else if(auto gray = std::get_if<DeviceGrayColor>(&sarg.c)) {
-                ERCV(serialize_G(app, ind, gray->v));
+                ERCV(serialize_G(serialisation, ind, gray->v));
             } else if(auto cmyk = std::get_if<DeviceCMYKColor>(&sarg.c)) {
-                ERCV(serialize_K(app, ind, cmyk->c, cmyk->m, cmyk->y, cmyk->k));
+                ERCV(serialize_K(serialisation, ind, cmyk->c, cmyk->m, cmyk->y, cmyk->k));
             } else {
                 printf("Given text stroke colorspace not supported yet.\n");
                 std::abort();
@@ -1017,11 +1143,11 @@ rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
 
         [&](const Nonstroke_arg &nsarg) -> rvoe<NoReturnValue> {
             if(auto rgb = std::get_if<DeviceRGBColor>(&nsarg.c)) {
-                ERCV(serialize_rg(app, ind, rgb->r, rgb->g, rgb->b));
+                ERCV(serialize_rg(serialisation, ind, rgb->r, rgb->g, rgb->b));
             } else if(auto gray = std::get_if<DeviceGrayColor>(&nsarg.c)) {
-                ERCV(serialize_g(app, ind, gray->v));
+                ERCV(serialize_g(serialisation, ind, gray->v));
             } else if(auto cmyk = std::get_if<DeviceCMYKColor>(&nsarg.c)) {
-                ERCV(serialize_k(app, ind, cmyk->c, cmyk->m, cmyk->y, cmyk->k));
+                ERCV(serialize_k(serialisation, ind, cmyk->c, cmyk->m, cmyk->y, cmyk->k));
             } else {
                 printf("Given text nonstroke colorspace not supported yet.\n");
                 std::abort();
@@ -1093,11 +1219,15 @@ rvoe<NoReturnValue> PdfDrawContext::render_glyphs(const std::vector<PdfGlyph> &g
         ERC(current_subset_glyph, doc->get_subset_glyph(fid, g.codepoint, {}));
         // const auto &bob = doc->font_objects.at(current_subset_glyph.ss.fid.id);
         used_subset_fonts.insert(current_subset_glyph.ss);
-        std::format_to(cmd_appender, "  {:f} {:f} Td\n", g.x - prev_x, g.y - prev_y);
+        commands += "  ";
+        append_coord(commands, g.x - prev_x, coord_precision());
+        commands += ' ';
+        append_coord(commands, g.y - prev_y, coord_precision());
+        commands += " Td\n";
         prev_x = g.x;
         prev_y = g.y;
-        std::format_to(
-            cmd_appender, "  <{:02x}> Tj\n", (unsigned char)current_subset_glyph.glyph_id);
+        const auto code_width = doc->fonts.at(fid.id).subsets.is_cid() ? 4 : 2;
+        std::format_to(cmd_appender, "  <{:0{}x}> Tj\n", current_subset_glyph.glyph_id, code_width);
     }
     std::format_to(cmd_appender, "{}ET\n", ind);
     RETOK;
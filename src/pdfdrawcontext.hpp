@@ -49,7 +49,7 @@ struct SerializedBasicContext {
 };
 
 struct SerializedXObject {
-    std::string dict; // FIXME, convert to unclosed so these can be compressed.
+    std::string unclosed_dict;
     std::string command_stream;
 };
 
@@ -137,30 +137,26 @@ public:
     rvoe<NoReturnValue> cmd_y(double x1, double y1, double x3, double y3);
 
     // Command serialization.
-    rvoe<NoReturnValue> serialize_G(std::back_insert_iterator<std::string> &out,
-                                    std::string_view indent,
-                                    LimitDouble gray) const;
-    rvoe<NoReturnValue> serialize_g(std::back_insert_iterator<std::string> &out,
-                                    std::string_view indent,
-                                    LimitDouble gray) const;
-    rvoe<NoReturnValue> serialize_K(std::back_insert_iterator<std::string> &out,
+    rvoe<NoReturnValue> serialize_G(std::string &out, std::string_view indent, LimitDouble gray) const;
+    rvoe<NoReturnValue> serialize_g(std::string &out, std::string_view indent, LimitDouble gray) const;
+    rvoe<NoReturnValue> serialize_K(std::string &out,
                                     std::string_view indent,
                                     LimitDouble c,
                                     LimitDouble m,
                                     LimitDouble y,
                                     LimitDouble k) const;
-    rvoe<NoReturnValue> serialize_k(std::back_insert_iterator<std::string> &out,
+    rvoe<NoReturnValue> serialize_k(std::string &out,
                                     std::string_view indent,
                                     LimitDouble c,
                                     LimitDouble m,
                                     LimitDouble y,
                                     LimitDouble k) const;
-    rvoe<NoReturnValue> serialize_RG(std::back_insert_iterator<std::string> &out,
+    rvoe<NoReturnValue> serialize_RG(std::string &out,
                                      std::string_view indent,
                                      LimitDouble r,
                                      LimitDouble g,
                                      LimitDouble b) const;
-    rvoe<NoReturnValue> serialize_rg(std::back_insert_iterator<std::string> &out,
+    rvoe<NoReturnValue> serialize_rg(std::string &out,
                                      std::string_view indent,
                                      LimitDouble r,
                                      LimitDouble g,
@@ -199,6 +195,13 @@ public:
     void draw_unit_circle();
     void draw_unit_box();
 
+    // Batched path construction, serialized in a single pass.
+    rvoe<NoReturnValue> draw_polyline(const double *points, size_t num_points);
+    rvoe<NoReturnValue> draw_path(const double *coords,
+                                  size_t num_coords,
+                                  const CapyPDF_Path_Operator *ops,
+                                  size_t num_ops);
+
     void clear();
 
     rvoe<NoReturnValue> add_form_widget(CapyPDF_FormWidgetId widget);
@@ -210,6 +213,15 @@ public:
     std::string build_resource_dict();
     std::string_view get_command_stream() { return commands; }
 
+    // Command buffer recycling. Reusing the capacity of a buffer from an
+    // already serialized context avoids reallocation churn when
+    // generating many similar pages.
+    void adopt_command_buffer(std::string buf) {
+        buf.clear();
+        commands = std::move(buf);
+    }
+    std::string release_command_buffer() { return std::move(commands); }
+
     double get_w() const { return w; }
     double get_h() const { return h; }
 
@@ -239,6 +251,8 @@ public:
     rvoe<NoReturnValue> set_custom_page_properties(const PageProperties &new_props);
 
 private:
+    int32_t coord_precision() const { return doc->opts.coordinate_precision; }
+
     rvoe<NoReturnValue> serialize_charsequence(const TextEvents &charseq,
                                                std::string &serialisation,
                                                CapyPDF_FontId &current_font,
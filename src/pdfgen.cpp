@@ -10,6 +10,7 @@
 #include <cassert>
 #include <stdexcept>
 #include <array>
+#include <thread>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_FONT_FORMATS_H
@@ -17,6 +18,18 @@
 
 namespace capypdf {
 
+DrawContextPopper::DrawContextPopper(PdfGen *g,
+                                     PdfDocument *doc,
+                                     PdfColorConverter *cm,
+                                     CapyPDF_Draw_Context_Type dtype,
+                                     double w,
+                                     double h)
+    : g{g}, ctx{doc, cm, dtype, w, h} {
+    if(dtype == CAPY_DC_PAGE) {
+        ctx.adopt_command_buffer(g->get_command_buffer());
+    }
+}
+
 DrawContextPopper::~DrawContextPopper() {
     switch(ctx.draw_context_type()) {
     case CAPY_DC_PAGE: {
@@ -49,21 +62,171 @@ rvoe<std::unique_ptr<PdfGen>> PdfGen::construct(const std::filesystem::path &ofn
         PdfColorConverter::construct(
             d.prof.rgb_profile_file, d.prof.gray_profile_file, d.prof.cmyk_profile_file));
     ERC(pdoc, PdfDocument::construct(d, std::move(cm)));
-    return std::unique_ptr<PdfGen>(new PdfGen(ofname, std::move(ft), std::move(pdoc)));
+    std::unique_ptr<PdfGen> gen(new PdfGen(ofname, std::move(ft), std::move(pdoc)));
+    if(d.streamed_writes) {
+        gen->writer = std::make_unique<PdfWriter>(gen->pdoc);
+        ERCV(gen->writer->begin_streaming(gen->ofilename));
+        gen->pdoc.stream_writer = gen->writer.get();
+    }
+    return gen;
+}
+
+rvoe<std::unique_ptr<PdfGen>> PdfGen::clone(const std::filesystem::path &new_ofname) const {
+    // In streamed mode parts of the document are already in the output
+    // file, so there is nothing coherent to copy.
+    if(writer) {
+        RETERR(CloneUnsupported);
+    }
+    FT_Library ft_;
+    auto error = FT_Init_FreeType(&ft_);
+    if(error) {
+        RETERR(FreeTypeError);
+    }
+    std::unique_ptr<FT_LibraryRec_, FT_Error (*)(FT_LibraryRec_ *)> new_ft(ft_, FT_Done_FreeType);
+    ERC(new_cm,
+        PdfColorConverter::construct(pdoc.opts.prof.rgb_profile_file,
+                                     pdoc.opts.prof.gray_profile_file,
+                                     pdoc.opts.prof.cmyk_profile_file));
+    ERC(doc_copy, pdoc.clone(std::move(new_cm), new_ft.get()));
+    std::unique_ptr<PdfGen> gen(new PdfGen(new_ofname, std::move(new_ft), std::move(doc_copy)));
+    return gen;
 }
 
 PdfGen::~PdfGen() {
+    if(pending_write.valid()) {
+        pending_write.wait();
+    }
     pdoc.font_objects.clear();
     pdoc.fonts.clear();
 }
 
 rvoe<NoReturnValue> PdfGen::write() {
+    if(writer) {
+        return writer->write_to_file(ofilename);
+    }
     PdfWriter pwriter(pdoc);
     return pwriter.write_to_file(ofilename);
 }
 
+rvoe<NoReturnValue> PdfGen::write_to_sink(CapyPDF_Write_Sink_Callback cb, void *ctx) {
+    if(!cb) {
+        RETERR(ArgIsNull);
+    }
+    if(writer) {
+        return writer->write_to_sink(cb, ctx);
+    }
+    PdfWriter pwriter(pdoc);
+    return pwriter.write_to_sink(cb, ctx);
+}
+
+rvoe<std::future<rvoe<NoReturnValue>>> PdfGen::write_async() {
+    if(pending_write.valid()) {
+        RETERR(AsyncWritePending);
+    }
+    return std::async(std::launch::async, [this] { return write(); });
+}
+
+rvoe<NoReturnValue> PdfGen::start_async_write(CapyPDF_Write_Completion_Callback cb,
+                                              void *user_data) {
+    if(pending_write.valid()) {
+        RETERR(AsyncWritePending);
+    }
+    pending_write = std::async(std::launch::async, [this, cb, user_data]() -> rvoe<NoReturnValue> {
+        auto rc = write();
+        if(cb) {
+            cb(rc ? (CapyPDF_EC)ErrorCode::NoError : (CapyPDF_EC)rc.error(), user_data);
+        }
+        return rc;
+    });
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfGen::wait_for_write() {
+    if(!pending_write.valid()) {
+        RETERR(NoAsyncWrite);
+    }
+    return pending_write.get();
+}
+
+double PdfGen::get_stat(CapyPDF_Stat stat) const {
+    const auto &s = pdoc.stats;
+    switch(stat) {
+    case CAPY_STAT_OBJECTS_WRITTEN:
+        return (double)s.objects_written;
+    case CAPY_STAT_BYTES_WRITTEN:
+        return (double)s.bytes_written;
+    case CAPY_STAT_CONTENT_BYTES_IN:
+        return (double)s.deflate_bytes_in[CAPY_STREAM_CLASS_CONTENT];
+    case CAPY_STAT_CONTENT_BYTES_OUT:
+        return (double)s.deflate_bytes_out[CAPY_STREAM_CLASS_CONTENT];
+    case CAPY_STAT_IMAGE_BYTES_IN:
+        return (double)s.deflate_bytes_in[CAPY_STREAM_CLASS_IMAGE];
+    case CAPY_STAT_IMAGE_BYTES_OUT:
+        return (double)s.deflate_bytes_out[CAPY_STREAM_CLASS_IMAGE];
+    case CAPY_STAT_FONT_BYTES_IN:
+        return (double)s.deflate_bytes_in[CAPY_STREAM_CLASS_FONT];
+    case CAPY_STAT_FONT_BYTES_OUT:
+        return (double)s.deflate_bytes_out[CAPY_STREAM_CLASS_FONT];
+    case CAPY_STAT_DEFLATE_SECONDS:
+        return s.deflate_seconds;
+    case CAPY_STAT_SUBSET_SECONDS:
+        return s.subset_seconds;
+    case CAPY_STAT_IMAGE_DECODE_SECONDS:
+        return s.image_decode_seconds;
+    case CAPY_STAT_WRITE_SECONDS:
+        return s.write_seconds;
+    }
+    return 0;
+}
+
 rvoe<RasterImage> PdfGen::load_image(const std::filesystem::path &fname) {
-    return load_image_file(fname);
+    const auto start = std::chrono::steady_clock::now();
+    auto rc = load_image_file(fname);
+    const auto elapsed = seconds_since(start);
+    pdoc.stats.image_decode_seconds += elapsed;
+    pdoc.trace_span("image-decode", elapsed);
+    return rc;
+}
+
+rvoe<std::vector<RasterImage>>
+PdfGen::load_images(const std::vector<std::filesystem::path> &fnames) {
+    uint32_t num_threads = pdoc.opts.num_threads;
+    if(num_threads == 0) {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    num_threads = std::min(num_threads, (uint32_t)fnames.size());
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<rvoe<RasterImage>> results(fnames.size());
+    if(num_threads > 1) {
+        std::vector<std::thread> workers;
+        workers.reserve(num_threads);
+        for(uint32_t tid = 0; tid < num_threads; ++tid) {
+            workers.emplace_back([tid, num_threads, &fnames, &results]() {
+                for(size_t i = tid; i < fnames.size(); i += num_threads) {
+                    results[i] = load_image_file(fnames[i]);
+                }
+            });
+        }
+        for(auto &w : workers) {
+            w.join();
+        }
+    } else {
+        for(size_t i = 0; i < fnames.size(); ++i) {
+            results[i] = load_image_file(fnames[i]);
+        }
+    }
+    const auto elapsed = seconds_since(start);
+    pdoc.stats.image_decode_seconds += elapsed;
+    pdoc.trace_span("image-decode", elapsed);
+    std::vector<RasterImage> images;
+    images.reserve(results.size());
+    for(auto &r : results) {
+        if(!r) {
+            return std::unexpected(r.error());
+        }
+        images.emplace_back(std::move(r.value()));
+    }
+    return images;
 }
 
 rvoe<CapyPDF_ImageId> PdfGen::add_image(RasterImage image, const ImagePDFProperties &params) {
@@ -74,10 +237,10 @@ rvoe<CapyPDF_ImageId> PdfGen::add_image(RasterImage image, const ImagePDFPropert
     }
 }
 
-rvoe<RasterImage> PdfGen::convert_image_to_cs(RasterImage image,
+rvoe<RasterImage> PdfGen::convert_image_to_cs(const RasterImage &image,
                                               CapyPDF_DeviceColorspace cs,
                                               CapyPDF_Rendering_Intent ri) const {
-    return pdoc.cm.convert_image_to(image, cs, ri);
+    return pdoc.cm.convert_image_to(image, cs, ri, pdoc.opts.num_threads);
 }
 
 rvoe<CapyPDF_ImageId> PdfGen::embed_jpg(const std::filesystem::path &fname,
@@ -86,6 +249,17 @@ rvoe<CapyPDF_ImageId> PdfGen::embed_jpg(const std::filesystem::path &fname,
     return pdoc.embed_jpg(std::move(jpg), interpolate);
 }
 
+rvoe<CapyPDF_ImageId> PdfGen::embed_png(const std::filesystem::path &fname,
+                                        CapyPDF_Image_Interpolation interpolate) {
+    auto png = load_png_for_passthrough(fname);
+    if(png) {
+        return pdoc.embed_png(std::move(png.value()), interpolate);
+    }
+    // Alpha channels, transparency and interlacing can not be copied
+    // through as is, those images get decoded like any other.
+    return pdoc.load_image(fname, interpolate);
+}
+
 rvoe<PageId> PdfGen::add_page(PdfDrawContext &ctx) {
     if(&ctx.get_doc() != &pdoc) {
         RETERR(IncorrectDocumentForObject);
@@ -102,17 +276,19 @@ rvoe<PageId> PdfGen::add_page(PdfDrawContext &ctx) {
     auto sc_var = ctx.serialize();
     assert(std::holds_alternative<SerializedBasicContext>(sc_var));
     auto &sc = std::get<SerializedBasicContext>(sc_var);
-    ERCV(pdoc.add_page(std::move(sc.resource_dict),
-                       std::move(sc.unclosed_object_dict),
-                       std::move(sc.command_stream),
-                       ctx.get_custom_props(),
-                       ctx.get_form_usage(),
-                       ctx.get_annotation_usage(),
-                       ctx.get_structure_usage(),
-                       ctx.get_transition(),
-                       ctx.get_subpage_navigation()));
+    ERC(page_num,
+        pdoc.add_page(std::move(sc.resource_dict),
+                      std::move(sc.unclosed_object_dict),
+                      std::move(sc.command_stream),
+                      ctx.get_custom_props(),
+                      ctx.get_form_usage(),
+                      ctx.get_annotation_usage(),
+                      ctx.get_structure_usage(),
+                      ctx.get_transition(),
+                      ctx.get_subpage_navigation()));
     ctx.clear();
-    return PageId{(int32_t)pdoc.pages.size() - 1};
+    recycle_command_buffer(ctx.release_command_buffer());
+    return PageId{page_num};
 }
 
 rvoe<CapyPDF_FormXObjectId> PdfGen::add_form_xobject(PdfDrawContext &ctx) {
@@ -125,7 +301,7 @@ rvoe<CapyPDF_FormXObjectId> PdfGen::add_form_xobject(PdfDrawContext &ctx) {
     auto sc_var = ctx.serialize();
     assert(std::holds_alternative<SerializedXObject>(sc_var));
     auto &sc = std::get<SerializedXObject>(sc_var);
-    pdoc.add_form_xobject(std::move(sc.dict), std::move(sc.command_stream));
+    pdoc.add_form_xobject(std::move(sc.unclosed_dict), std::move(sc.command_stream));
     ctx.clear();
     CapyPDF_FormXObjectId fxoid;
     fxoid.id = (int32_t)pdoc.form_xobjects.size() - 1;
@@ -134,6 +310,25 @@ rvoe<CapyPDF_FormXObjectId> PdfGen::add_form_xobject(PdfDrawContext &ctx) {
 
 rvoe<CapyPDF_PatternId> PdfGen::add_pattern(PdfDrawContext &ctx) { return pdoc.add_pattern(ctx); }
 
+std::string PdfGen::get_command_buffer() {
+    std::lock_guard<std::mutex> lock(*buffer_pool_mutex);
+    if(command_buffer_pool.empty()) {
+        return std::string{};
+    }
+    auto buf = std::move(command_buffer_pool.back());
+    command_buffer_pool.pop_back();
+    return buf;
+}
+
+void PdfGen::recycle_command_buffer(std::string buf) {
+    const size_t max_pooled_buffers = 8;
+    std::lock_guard<std::mutex> lock(*buffer_pool_mutex);
+    if(command_buffer_pool.size() < max_pooled_buffers) {
+        buf.clear();
+        command_buffer_pool.push_back(std::move(buf));
+    }
+}
+
 DrawContextPopper PdfGen::guarded_page_context() {
     return DrawContextPopper{this,
                              &pdoc,
@@ -144,11 +339,13 @@ DrawContextPopper PdfGen::guarded_page_context() {
 }
 
 PdfDrawContext *PdfGen::new_page_draw_context() {
-    return new PdfDrawContext{&pdoc,
-                              &pdoc.cm,
-                              CAPY_DC_PAGE,
-                              pdoc.opts.default_page_properties.mediabox->w(),
-                              pdoc.opts.default_page_properties.mediabox->h()};
+    auto *ctx = new PdfDrawContext{&pdoc,
+                                   &pdoc.cm,
+                                   CAPY_DC_PAGE,
+                                   pdoc.opts.default_page_properties.mediabox->w(),
+                                   pdoc.opts.default_page_properties.mediabox->h()};
+    ctx->adopt_command_buffer(get_command_buffer());
+    return ctx;
 }
 
 PdfDrawContext PdfGen::new_color_pattern_builder(double w, double h) {
@@ -12,6 +12,8 @@
 #include <string_view>
 #include <optional>
 #include <filesystem>
+#include <future>
+#include <mutex>
 
 namespace capypdf {
 
@@ -26,8 +28,7 @@ struct DrawContextPopper {
                                PdfColorConverter *cm,
                                CapyPDF_Draw_Context_Type dtype,
                                double w,
-                               double h)
-        : g{g}, ctx{doc, cm, dtype, w, h} {}
+                               double h);
 
     DrawContextPopper() = delete;
     DrawContextPopper(const DrawContextPopper &) = delete;
@@ -42,12 +43,46 @@ public:
     PdfGen(PdfGen &&o) = default;
     ~PdfGen();
 
+    // A new generator writing to the given path, starting from a deep
+    // copy of this generator's current state. Load fonts, profiles and
+    // template resources once, then clone per output document so the
+    // setup cost is paid only once per batch. Not available when
+    // streamed writes are enabled or the document holds memory mapped
+    // streams.
+    rvoe<std::unique_ptr<PdfGen>> clone(const std::filesystem::path &ofname) const;
+
     rvoe<NoReturnValue> write();
 
+    // Writes the document through a caller-supplied sink callback
+    // instead of the output file. Use to keep the PDF bytes in memory
+    // or to send them to a socket without touching the disk.
+    rvoe<NoReturnValue> write_to_sink(CapyPDF_Write_Sink_Callback cb, void *ctx);
+
+    // The generator must not be touched while a write is in flight.
+    rvoe<std::future<rvoe<NoReturnValue>>> write_async();
+    rvoe<NoReturnValue> start_async_write(CapyPDF_Write_Completion_Callback cb, void *user_data);
+    rvoe<NoReturnValue> wait_for_write();
+
+    // Reads the given performance counter, see CapyPDF_Stat.
+    double get_stat(CapyPDF_Stat stat) const;
+    void set_trace_callback(CapyPDF_Trace_Callback cb, void *ctx) {
+        pdoc.trace_cb = cb;
+        pdoc.trace_ctx = ctx;
+    }
+
     rvoe<RasterImage> load_image(const std::filesystem::path &fname);
+
+    // Decodes independent images concurrently in a worker pool sized by
+    // the num_threads option. The result order matches the input order.
+    rvoe<std::vector<RasterImage>> load_images(const std::vector<std::filesystem::path> &fnames);
     rvoe<CapyPDF_ImageId>
     embed_jpg(const std::filesystem::path &fname,
               CapyPDF_Image_Interpolation interpolate = CAPY_INTERPOLATION_AUTO);
+    // Copies the compressed PNG data into the output without decoding
+    // when possible, otherwise falls back to the regular image path.
+    rvoe<CapyPDF_ImageId>
+    embed_png(const std::filesystem::path &fname,
+              CapyPDF_Image_Interpolation interpolate = CAPY_INTERPOLATION_AUTO);
     rvoe<CapyPDF_EmbeddedFileId> embed_file(const std::filesystem::path &fname) {
         return pdoc.embed_file(fname);
     }
@@ -55,7 +90,13 @@ public:
         return pdoc.load_font(ft.get(), fname);
     };
 
-    rvoe<RasterImage> convert_image_to_cs(RasterImage image,
+    // Like load_font but produces a CID-keyed (Type0) font, which can
+    // hold tens of thousands of glyphs in a single subset.
+    rvoe<CapyPDF_FontId> load_cid_font(const std::filesystem::path &fname) {
+        return pdoc.load_font(ft.get(), fname, true);
+    };
+
+    rvoe<RasterImage> convert_image_to_cs(const RasterImage &image,
                                           CapyPDF_DeviceColorspace cs,
                                           CapyPDF_Rendering_Intent ri) const;
     rvoe<CapyPDF_ImageId> add_image(RasterImage ri, const ImagePDFProperties &params);
@@ -167,11 +208,25 @@ private:
     PdfGen(std::filesystem::path ofilename,
            std::unique_ptr<FT_LibraryRec_, FT_Error (*)(FT_LibraryRec_ *)> ft,
            PdfDocument pdoc)
-        : ofilename(std::move(ofilename)), ft(std::move(ft)), pdoc(std::move(pdoc)) {}
+        : ofilename(std::move(ofilename)), ft(std::move(ft)), pdoc(std::move(pdoc)),
+          buffer_pool_mutex(std::make_unique<std::mutex>()) {}
+
+    std::string get_command_buffer();
+    void recycle_command_buffer(std::string buf);
 
     std::filesystem::path ofilename;
     std::unique_ptr<FT_LibraryRec_, FT_Error (*)(FT_LibraryRec_ *)> ft;
     PdfDocument pdoc;
+    // Only created up front when streamed writes are enabled.
+    std::unique_ptr<PdfWriter> writer;
+    std::future<rvoe<NoReturnValue>> pending_write;
+    // Recycled page command buffers, kept to avoid reallocating the
+    // command stream from scratch for every page. The pool is shared
+    // between all threads building pages.
+    std::unique_ptr<std::mutex> buffer_pool_mutex;
+    std::vector<std::string> command_buffer_pool;
+
+    friend struct DrawContextPopper;
 };
 
 struct GenPopper {
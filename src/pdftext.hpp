@@ -39,10 +39,20 @@ struct ActualTextStart {
 
 struct ActualTextEnd {};
 
+// A run of pre-shaped glyphs submitted in one go. Kerns hold the TJ
+// adjustment emitted after each glyph in font space units, zero emits
+// nothing.
+struct GlyphRun {
+    std::vector<uint32_t> glyph_ids;
+    std::vector<uint32_t> codepoints;
+    std::vector<int32_t> kerns;
+};
+
 typedef std::variant<KerningValue,
                      UnicodeCharacter,
                      GlyphItem,
                      GlyphTextItem,
+                     GlyphRun,
                      ActualTextStart,
                      ActualTextEnd>
     TextAtom;
@@ -71,6 +81,15 @@ public:
         return NoReturnValue{};
     }
 
+    rvoe<NoReturnValue> append_shaped_run(GlyphRun run) {
+        if(run.glyph_ids.size() != run.codepoints.size() ||
+           run.glyph_ids.size() != run.kerns.size()) {
+            RETERR(IndexOutOfBounds);
+        }
+        e.emplace_back(std::move(run));
+        return NoReturnValue{};
+    }
+
     rvoe<NoReturnValue> append_actualtext_start(const u8string &at) {
         if(is_actualtext()) {
             RETERR(DrawStateEndMismatch);
@@ -4,7 +4,9 @@
 #include <pdfwriter.hpp>
 #include <utils.hpp>
 
+#include <algorithm>
 #include <format>
+#include <thread>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_FONT_FORMATS_H
@@ -53,12 +55,21 @@ std::string subsetfontname2pdfname(std::string_view original, const int32_t subs
     return out;
 }
 
-void write_rectangle(auto &appender, const char *boxname, const capypdf::PdfRectangle &box) {
-    std::format_to(
-        appender, "  /{} [ {:f} {:f} {:f} {:f} ]\n", boxname, box.x1, box.y1, box.x2, box.y2);
+void write_rectangle(std::string &buf,
+                     const char *boxname,
+                     const capypdf::PdfRectangle &box,
+                     int32_t precision) {
+    buf += "  /";
+    buf += boxname;
+    buf += " [ ";
+    for(const auto v : {box.x1, box.y1, box.x2, box.y2}) {
+        capypdf::append_coord(buf, v, precision);
+        buf += ' ';
+    }
+    buf += "]\n";
 }
 
-std::string create_subset_cmap(const std::vector<capypdf::TTGlyphs> &glyphs) {
+std::string create_subset_cmap(const std::vector<capypdf::TTGlyphs> &glyphs, bool is_cid) {
     std::string buf = std::format(R"(/CIDInit/ProcSet findresource begin
 12 dict begin
 begincmap
@@ -70,25 +81,27 @@ begincmap
 /CMapName/Adobe-Identity-UCS def
 /CMapType 2 def
 1 begincodespacerange
-<00> <FF>
+{}
 endcodespacerange
 {} beginbfchar
 )",
+                                  is_cid ? "<0000> <FFFF>" : "<00> <FF>",
                                   glyphs.size() - 1);
     // Glyph zero is not mapped.
     auto appender = std::back_inserter(buf);
     for(size_t i = 1; i < glyphs.size(); ++i) {
         const auto &g = glyphs[i];
+        const auto code_width = is_cid ? 4 : 2;
         if(std::holds_alternative<LigatureGlyph>(g)) {
             const auto &lg = std::get<LigatureGlyph>(g);
             const auto u16repr = utf8_to_pdfutf16be(lg.text, false);
-            std::format_to(appender, "<{:02X}> <{}>\n", i, u16repr);
+            std::format_to(appender, "<{:0{}X}> <{}>\n", i, code_width, u16repr);
         } else {
             uint32_t unicode_codepoint = 0;
             if(std::holds_alternative<capypdf::RegularGlyph>(g)) {
                 unicode_codepoint = std::get<capypdf::RegularGlyph>(g).unicode_codepoint;
             }
-            std::format_to(appender, "<{:02X}> <{:04X}>\n", i, unicode_codepoint);
+            std::format_to(appender, "<{:0{}X}> <{:04X}>\n", i, code_width, unicode_codepoint);
         }
     }
     buf += R"(endbfchar
@@ -128,6 +141,40 @@ rvoe<std::string> build_subset_width_array(FT_Face face,
 
 PdfWriter::PdfWriter(PdfDocument &doc) : doc(doc) {}
 
+PdfWriter::~PdfWriter() {
+    // In streaming mode the output file is kept open for the lifetime of
+    // the generator. If generation was aborted, get rid of the leftovers.
+    if(ofile) {
+        fclose(ofile);
+        ofile = nullptr;
+        if(!streaming_tempfile.empty()) {
+            std::error_code ec;
+            std::filesystem::remove(streaming_tempfile, ec);
+        }
+    }
+}
+
+rvoe<NoReturnValue> PdfWriter::begin_streaming(const std::filesystem::path &ofilename) {
+    assert(ofile == nullptr);
+    auto tempfname = ofilename;
+    tempfname.replace_extension(".pdf~");
+    ofile = fopen(tempfname.string().c_str(), "wb");
+    if(!ofile) {
+        perror(nullptr);
+        RETERR(CouldNotOpenFile);
+    }
+    streaming_tempfile = std::move(tempfname);
+    return write_header();
+}
+
+rvoe<int64_t> PdfWriter::write_streamed_object(int32_t object_number,
+                                               std::string_view dict_data,
+                                               std::string_view stream_data) {
+    const int64_t offset = current_offset();
+    ERCV(write_finished_object(object_number, dict_data, stream_data));
+    return offset;
+}
+
 rvoe<NoReturnValue> PdfWriter::write_to_file(const std::filesystem::path &ofilename) {
     if(doc.pages.size() == 0) {
         RETERR(NoPages);
@@ -138,10 +185,16 @@ rvoe<NoReturnValue> PdfWriter::write_to_file(const std::filesystem::path &ofilen
     doc.write_attempted = true;
     auto tempfname = ofilename;
     tempfname.replace_extension(".pdf~");
-    FILE *ofile = fopen(tempfname.string().c_str(), "wb");
-    if(!ofile) {
-        perror(nullptr);
-        RETERR(CouldNotOpenFile);
+    FILE *ofile; // Deliberately shadows the member so the cleanup below works in both modes.
+    if(streaming_tempfile.empty()) {
+        ofile = fopen(tempfname.string().c_str(), "wb");
+        if(!ofile) {
+            perror(nullptr);
+            RETERR(CouldNotOpenFile);
+        }
+    } else {
+        assert(tempfname == streaming_tempfile);
+        ofile = this->ofile;
     }
 
     try {
@@ -186,14 +239,56 @@ rvoe<NoReturnValue> PdfWriter::write_to_file(const std::filesystem::path &ofilen
         fprintf(stderr, "%s\n", ec.category().message(ec.value()).c_str());
         RETERR(FileWriteError);
     }
+    streaming_tempfile.clear();
     return NoReturnValue{};
 }
 
+rvoe<NoReturnValue> PdfWriter::write_to_sink(CapyPDF_Write_Sink_Callback cb, void *ctx) {
+    if(doc.pages.size() == 0) {
+        RETERR(NoPages);
+    }
+    if(doc.write_attempted) {
+        RETERR(WritingTwice);
+    }
+    if(!streaming_tempfile.empty()) {
+        // Streamed writes have already put parts of the document in the
+        // output file, so the bytes can not be rerouted any more.
+        RETERR(BadOptionCombination);
+    }
+    doc.write_attempted = true;
+    sink_cb = cb;
+    sink_ctx = ctx;
+    try {
+        const auto start = std::chrono::steady_clock::now();
+        auto rc = write_to_file_impl();
+        const auto elapsed = seconds_since(start);
+        doc.stats.write_seconds += elapsed;
+        doc.trace_span("write", elapsed);
+        sink_cb = nullptr;
+        sink_ctx = nullptr;
+        return rc;
+    } catch(const std::exception &e) {
+        sink_cb = nullptr;
+        sink_ctx = nullptr;
+        fprintf(stderr, "%s\n", e.what());
+        RETERR(DynamicError);
+    } catch(...) {
+        sink_cb = nullptr;
+        sink_ctx = nullptr;
+        fprintf(stderr, "Unexpected error.\n");
+        RETERR(DynamicError);
+    }
+}
+
 rvoe<NoReturnValue> PdfWriter::write_to_file(FILE *output_file) {
-    assert(ofile == nullptr);
+    assert(ofile == nullptr || ofile == output_file);
     ofile = output_file;
     try {
+        const auto start = std::chrono::steady_clock::now();
         auto rc = write_to_file_impl();
+        const auto elapsed = seconds_since(start);
+        doc.stats.write_seconds += elapsed;
+        doc.trace_span("write", elapsed);
         ofile = nullptr;
         return rc;
     } catch(...) {
@@ -203,21 +298,65 @@ rvoe<NoReturnValue> PdfWriter::write_to_file(FILE *output_file) {
 }
 
 rvoe<NoReturnValue> PdfWriter::write_to_file_impl() {
-    ERCV(write_header());
+    if(streaming_tempfile.empty()) {
+        if(doc.incremental_base) {
+            // An incremental update starts with the base file verbatim,
+            // new objects and the updated xref are appended after it.
+            ERCV(write_bytes(doc.incremental_base->contents));
+        } else {
+            ERCV(write_header());
+        }
+    }
     ERCV(doc.create_catalog());
+    doc.build_page_tree();
     doc.pad_subset_fonts();
+    ERCV(prefinalize_delayed_objects());
     ERC(object_offsets, write_objects());
-    const int64_t xref_offset = ftell(ofile);
-    ERCV(write_cross_reference_table(object_offsets));
-    ERCV(write_trailer(xref_offset));
+    if(doc.opts.use_object_streams) {
+        ERCV(write_object_streams_and_xref(object_offsets));
+    } else {
+        const int64_t xref_offset = current_offset();
+        ERCV(write_cross_reference_table(object_offsets));
+        ERCV(write_trailer(xref_offset));
+    }
+    ERCV(flush_output_buffer());
+    doc.stats.bytes_written = current_offset();
     return NoReturnValue{};
 }
 
 rvoe<NoReturnValue> PdfWriter::write_bytes(const char *buf, size_t buf_size) {
-    if(fwrite(buf, 1, buf_size, ofile) != buf_size) {
+    // Chunks at least as big as the buffer (image data, mmapped files)
+    // go to the sink directly so they do not get copied at all.
+    if(buf_size >= output_buffer_capacity) {
+        ERCV(flush_output_buffer());
+        return sink_write(buf, buf_size);
+    }
+    output_buffer.append(buf, buf_size);
+    if(output_buffer.size() >= output_buffer_capacity) {
+        return flush_output_buffer();
+    }
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::flush_output_buffer() {
+    if(output_buffer.empty()) {
+        return NoReturnValue{};
+    }
+    ERCV(sink_write(output_buffer.data(), output_buffer.size()));
+    output_buffer.clear();
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::sink_write(const char *buf, size_t buf_size) {
+    if(sink_cb) {
+        if(sink_cb(buf, (int64_t)buf_size, sink_ctx) != 0) {
+            RETERR(WriteCallbackFailed);
+        }
+    } else if(fwrite(buf, 1, buf_size, ofile) != buf_size) {
         perror(nullptr);
         RETERR(FileWriteError);
     }
+    bytes_flushed += buf_size;
     return NoReturnValue{};
 }
 
@@ -225,6 +364,89 @@ rvoe<NoReturnValue> PdfWriter::write_header() {
     return write_bytes(PDF_header, strlen(PDF_header));
 }
 
+rvoe<NoReturnValue> PdfWriter::prefinalize_delayed_objects() {
+    uint32_t num_threads = doc.opts.num_threads;
+    if(num_threads == 0) {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    if(num_threads <= 1) {
+        return NoReturnValue{};
+    }
+    // Font subset generation and stream compression do not depend on
+    // each other, only the final write order does. Subsets of the same
+    // font share an FT_Face, which is not thread safe, so work is
+    // grouped by font rather than by object.
+    std::vector<std::vector<int32_t>> groups;
+    std::unordered_map<int32_t, size_t> font_groups;
+    for(size_t i = 0; i < doc.document_objects.size(); ++i) {
+        if(auto *ssfont = std::get_if<DelayedSubsetFontData>(&doc.document_objects[i])) {
+            auto it = font_groups.find(ssfont->fid.id);
+            if(it == font_groups.end()) {
+                it = font_groups.emplace(ssfont->fid.id, groups.size()).first;
+                groups.emplace_back();
+            }
+            groups[it->second].push_back((int32_t)i);
+        } else if(std::holds_alternative<DeflatePDFObject>(doc.document_objects[i])) {
+            groups.emplace_back(std::vector<int32_t>{(int32_t)i});
+        }
+    }
+    if(groups.size() < 2) {
+        return NoReturnValue{};
+    }
+    const auto start = std::chrono::steady_clock::now();
+    num_threads = std::min(num_threads, (uint32_t)groups.size());
+    auto finalize_object = [this](int32_t objnum) -> rvoe<PrefinalizedStream> {
+        if(auto *ssfont = std::get_if<DelayedSubsetFontData>(&doc.document_objects[objnum])) {
+            const auto &font = doc.fonts.at(ssfont->fid.id);
+            ERC(subset_font,
+                font.subsets.generate_subset(
+                    font.fontdata.face.get(), *font.fontdata.fontdata, ssfont->subset_id));
+            ERC(compressed, flate_compress(subset_font, 1, doc.opts.compression.font_level));
+            return PrefinalizedStream{std::move(compressed), subset_font.size()};
+        }
+        const auto &pobj = std::get<DeflatePDFObject>(doc.document_objects[objnum]);
+        ERC(compressed,
+            flate_compress(pobj.stream, 1, doc.opts.compression.level_for(pobj.stream_class)));
+        return PrefinalizedStream{std::move(compressed), pobj.stream.size()};
+    };
+    std::vector<rvoe<PrefinalizedStream>> results(doc.document_objects.size());
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads);
+    for(uint32_t tid = 0; tid < num_threads; ++tid) {
+        workers.emplace_back([tid, num_threads, &groups, &results, &finalize_object]() {
+            for(size_t g = tid; g < groups.size(); g += num_threads) {
+                for(const auto objnum : groups[g]) {
+                    results[objnum] = finalize_object(objnum);
+                }
+            }
+        });
+    }
+    for(auto &w : workers) {
+        w.join();
+    }
+    for(const auto &group : groups) {
+        for(const auto objnum : group) {
+            auto &r = results[objnum];
+            if(!r) {
+                return std::unexpected(r.error());
+            }
+            auto sclass = CAPY_STREAM_CLASS_FONT;
+            if(auto *defl = std::get_if<DeflatePDFObject>(&doc.document_objects[objnum])) {
+                sclass = defl->stream_class;
+            }
+            doc.stats.deflate_bytes_in[sclass] += r->uncompressed_size;
+            doc.stats.deflate_bytes_out[sclass] += r->compressed.size();
+            prefinalized.emplace(objnum, std::move(r.value()));
+        }
+    }
+    // Subsetting and compression are interleaved in the workers, the
+    // wall time of the whole phase is counted as compression.
+    const auto elapsed = seconds_since(start);
+    doc.stats.deflate_seconds += elapsed;
+    doc.trace_span("prefinalize", elapsed);
+    return NoReturnValue{};
+}
+
 rvoe<std::vector<uint64_t>> PdfWriter::write_objects() {
     size_t i = 0;
     auto visitor = overloaded{
@@ -236,7 +458,23 @@ rvoe<std::vector<uint64_t>> PdfWriter::write_objects() {
         },
 
         [&](const DeflatePDFObject &pobj) -> rvoe<NoReturnValue> {
-            ERC(compressed, flate_compress(pobj.stream));
+            std::string compressed;
+            auto pf = prefinalized.find((int32_t)i);
+            if(pf != prefinalized.end()) {
+                compressed = std::move(pf->second.compressed);
+            } else {
+                const auto start = std::chrono::steady_clock::now();
+                ERC(c,
+                    flate_compress(pobj.stream,
+                                   doc.opts.num_threads,
+                                   doc.opts.compression.level_for(pobj.stream_class)));
+                compressed = std::move(c);
+                doc.stats.deflate_seconds += seconds_since(start);
+                // Prefinalized streams were already accounted for when
+                // they were compressed.
+                doc.stats.deflate_bytes_in[pobj.stream_class] += pobj.stream.size();
+                doc.stats.deflate_bytes_out[pobj.stream_class] += compressed.size();
+            }
             std::string dict = std::format("{}  /Filter /FlateDecode\n  /Length {}\n>>\n",
                                            pobj.unclosed_dictionary,
                                            compressed.size());
@@ -244,6 +482,28 @@ rvoe<std::vector<uint64_t>> PdfWriter::write_objects() {
             return NoReturnValue{};
         },
 
+        [&](const MappedFilePDFObject &pobj) -> rvoe<NoReturnValue> {
+            ERCV(write_finished_object(i, pobj.dictionary, pobj.file.sv()));
+            return NoReturnValue{};
+        },
+
+        [&](const DeflateMappedFilePDFObject &pobj) -> rvoe<NoReturnValue> {
+            ERCV(write_deflated_mapped_object(i, pobj));
+            return NoReturnValue{};
+        },
+
+        [&](const DelayedStreamLength &sl) -> rvoe<NoReturnValue> {
+            ++doc.stats.objects_written;
+            // A stream length object may not live inside an object
+            // stream, so it is written out directly even when object
+            // streams are in use.
+            const auto body =
+                std::format("{} 0 obj\n{}\nendobj\n", i, stream_lengths.at(sl.stream_obj));
+            return write_bytes(body);
+        },
+
+        [](const WrittenObject &) -> rvoe<NoReturnValue> { return NoReturnValue{}; },
+
         [&](const DelayedSubsetFontData &ssfont) -> rvoe<NoReturnValue> {
             ERCV(write_subset_font_data(i, ssfont));
             return NoReturnValue{};
@@ -267,7 +527,14 @@ rvoe<std::vector<uint64_t>> PdfWriter::write_objects() {
                                    doc.fonts.at(ssfont.fid.id),
                                    0,
                                    ssfont.subfont_descriptor_obj,
-                                   ssfont.subfont_cmap_obj));
+                                   ssfont.subfont_cmap_obj,
+                                   ssfont.subfont_descendant_obj));
+            return NoReturnValue{};
+        },
+
+        [&](const DelayedSubsetCIDFont &ssfont) -> rvoe<NoReturnValue> {
+            ERCV(write_subset_cid_font(
+                i, doc.fonts.at(ssfont.fid.id), ssfont.subset_id, ssfont.subfont_descriptor_obj));
             return NoReturnValue{};
         },
 
@@ -299,7 +566,17 @@ rvoe<std::vector<uint64_t>> PdfWriter::write_objects() {
 
     std::vector<uint64_t> object_offsets;
     for(; i < doc.document_objects.size(); ++i) {
-        object_offsets.push_back(ftell(ofile));
+        if(auto *written = std::get_if<WrittenObject>(&doc.document_objects.at(i))) {
+            object_offsets.push_back(written->offset);
+            continue;
+        }
+        if(i > 0 && std::holds_alternative<DummyIndexZero>(doc.document_objects.at(i))) {
+            // A numbering slot reserved for another shard, becomes a
+            // free cross reference entry.
+            object_offsets.push_back(0);
+            continue;
+        }
+        object_offsets.push_back(current_offset());
         ERCV(std::visit(visitor, doc.document_objects.at(i)));
     }
     return object_offsets;
@@ -314,20 +591,20 @@ PdfWriter::write_cross_reference_table(const std::vector<uint64_t> &object_offse
 0 {}
 )",
                    object_offsets.size());
-    bool first = true;
-    for(const auto &i : object_offsets) {
-        if(first) {
+    for(size_t i = 0; i < object_offsets.size(); ++i) {
+        if(i == 0 || object_offsets[i] == 0) {
+            // Slot zero and numbering slots reserved for other shards.
             buf += "0000000000 65535 f \n"; // The end of line whitespace is significant.
-            first = false;
         } else {
-            std::format_to(app, "{:010} 00000 n \n", i);
+            std::format_to(app, "{:010} 00000 n \n", object_offsets[i]);
         }
     }
     return write_bytes(buf);
 }
 
 rvoe<NoReturnValue> PdfWriter ::write_trailer(int64_t xref_offset) {
-    const int32_t info = 1;                               // Info object is the first printed.
+    // Info object is the first one printed after any reserved shard slots.
+    const int32_t info = doc.opts.shard_object_offset + 1;
     const int32_t root = doc.document_objects.size() - 1; // Root object is the last one printed.
     std::string buf;
     auto documentid = create_trailer_id();
@@ -338,7 +615,7 @@ rvoe<NoReturnValue> PdfWriter ::write_trailer(int64_t xref_offset) {
   /Root {} 0 R
   /Info {} 0 R
   /ID [{}{}]
->>
+{}>>
 startxref
 {}
 %%EOF
@@ -348,41 +625,191 @@ startxref
                    info,
                    documentid,
                    documentid,
+                   doc.incremental_base
+                       ? std::format("  /Prev {}\n", doc.incremental_base->xref_offset)
+                       : std::string{},
                    xref_offset);
     return write_bytes(buf);
 }
 
+rvoe<NoReturnValue>
+PdfWriter::write_object_streams_and_xref(const std::vector<uint64_t> &object_offsets) {
+    const size_t max_objects_per_stream = 100;
+    struct XrefEntry {
+        uint8_t type;
+        uint64_t field2; // File offset or containing object stream number.
+        uint16_t field3; // Generation or index within the object stream.
+    };
+    std::vector<XrefEntry> entries;
+    entries.reserve(object_offsets.size() + objstm_pending.size() / max_objects_per_stream + 2);
+    entries.push_back(XrefEntry{0, 0, 0xffff});
+    for(size_t i = 1; i < object_offsets.size(); ++i) {
+        entries.push_back(XrefEntry{1, object_offsets.at(i), 0});
+    }
+    int32_t next_obj_num = (int32_t)object_offsets.size();
+    for(size_t batch_start = 0; batch_start < objstm_pending.size();
+        batch_start += max_objects_per_stream) {
+        const auto batch_end =
+            std::min(batch_start + max_objects_per_stream, objstm_pending.size());
+        const int32_t stream_obj_num = next_obj_num++;
+        std::string header;
+        std::string body;
+        auto happ = std::back_inserter(header);
+        for(size_t i = batch_start; i < batch_end; ++i) {
+            const auto &[onum, odata] = objstm_pending.at(i);
+            std::format_to(happ, "{} {} ", onum, body.size());
+            entries.at(onum) = XrefEntry{2, (uint64_t)stream_obj_num, (uint16_t)(i - batch_start)};
+            body += odata;
+        }
+        header.back() = '\n';
+        ERC(compressed,
+            flate_compress(header + body, doc.opts.num_threads, doc.opts.compression.content_level));
+        auto dict = std::format(R"(<<
+  /Type /ObjStm
+  /N {}
+  /First {}
+  /Filter /FlateDecode
+  /Length {}
+>>
+)",
+                                batch_end - batch_start,
+                                header.size(),
+                                compressed.size());
+        entries.push_back(XrefEntry{1, (uint64_t)current_offset(), 0});
+        ERCV(write_finished_object(stream_obj_num, dict, compressed));
+    }
+    // The cross reference stream is the last object and refers to itself.
+    const int32_t xref_obj_num = next_obj_num++;
+    const int64_t xref_offset = current_offset();
+    entries.push_back(XrefEntry{1, (uint64_t)xref_offset, 0});
+    uint64_t max_offset = 0;
+    for(const auto &e : entries) {
+        if(e.type == 1) {
+            max_offset = std::max(max_offset, e.field2);
+        }
+    }
+    const int32_t offset_width = max_offset > 0xffffffffULL ? 8 : 4;
+    std::string rows;
+    rows.reserve(entries.size() * (3 + offset_width));
+    for(const auto &e : entries) {
+        rows.push_back((char)e.type);
+        for(int32_t b = offset_width - 1; b >= 0; --b) {
+            rows.push_back((char)((e.field2 >> (8 * b)) & 0xff));
+        }
+        rows.push_back((char)((e.field3 >> 8) & 0xff));
+        rows.push_back((char)(e.field3 & 0xff));
+    }
+    ERC(compressed_rows,
+        flate_compress(rows, doc.opts.num_threads, doc.opts.compression.content_level));
+    const int32_t info = 1;                               // Info object is the first printed.
+    const int32_t root = doc.document_objects.size() - 1; // Root object is the last one printed.
+    auto documentid = create_trailer_id();
+    auto dict = std::format(R"(<<
+  /Type /XRef
+  /Size {}
+  /W [ 1 {} 2 ]
+  /Root {} 0 R
+  /Info {} 0 R
+  /ID [{}{}]
+  /Filter /FlateDecode
+  /Length {}
+>>
+)",
+                            entries.size(),
+                            offset_width,
+                            root,
+                            info,
+                            documentid,
+                            documentid,
+                            compressed_rows.size());
+    ERCV(write_finished_object(xref_obj_num, dict, compressed_rows));
+    return write_bytes(std::format("startxref\n{}\n%%EOF\n", xref_offset));
+}
+
 rvoe<NoReturnValue> PdfWriter::write_finished_object(int32_t object_number,
                                                      std::string_view dict_data,
                                                      std::string_view stream_data) {
+    ++doc.stats.objects_written;
+    if(doc.opts.use_object_streams && stream_data.empty()) {
+        // Non-stream objects get packed into compressed object streams
+        // that are written just before the cross reference stream.
+        std::string body{dict_data};
+        if(!body.empty() && body.back() != '\n') {
+            body += '\n';
+        }
+        objstm_pending.emplace_back(object_number, std::move(body));
+        return NoReturnValue{};
+    }
     std::string buf;
     auto appender = std::back_inserter(buf);
     std::format_to(appender, "{} 0 obj\n", object_number);
     buf += dict_data;
+    if(buf.back() != '\n') {
+        buf += '\n';
+    }
     if(!stream_data.empty()) {
-        if(buf.back() != '\n') {
-            buf += '\n';
-        }
+        // Gather-style write. The stream body is handed to the output
+        // buffer as is instead of being copied next to the header.
         buf += "stream\n";
-        buf += stream_data;
-        if(buf.back() != '\n') {
+        ERCV(write_bytes(buf));
+        ERCV(write_bytes(stream_data));
+        buf.clear();
+        if(stream_data.back() != '\n') {
             buf += '\n';
         }
         buf += "endstream\n";
     }
+    buf += "endobj\n";
+    return write_bytes(buf);
+}
+
+rvoe<NoReturnValue> PdfWriter::write_deflated_mapped_object(int32_t object_number,
+                                                            const DeflateMappedFilePDFObject &pobj) {
+    ++doc.stats.objects_written;
+    std::string buf;
+    std::format_to(std::back_inserter(buf), "{} 0 obj\n", object_number);
+    buf += pobj.dictionary;
     if(buf.back() != '\n') {
         buf += '\n';
     }
-    buf += "endobj\n";
-    return write_bytes(buf);
+    buf += "stream\n";
+    ERCV(write_bytes(buf));
+    const auto start = std::chrono::steady_clock::now();
+    ERC(compressed_size,
+        flate_compress_to(pobj.file.sv(),
+                          doc.opts.compression.content_level,
+                          [this](std::string_view block) { return write_bytes(block); }));
+    doc.stats.deflate_seconds += seconds_since(start);
+    doc.stats.deflate_bytes_in[CAPY_STREAM_CLASS_CONTENT] += pobj.file.sv().size();
+    doc.stats.deflate_bytes_out[CAPY_STREAM_CLASS_CONTENT] += compressed_size;
+    stream_lengths[object_number] = compressed_size;
+    ERCV(write_bytes("\nendstream\nendobj\n"));
+    return NoReturnValue{};
 }
 
 rvoe<NoReturnValue> PdfWriter::write_subset_font(int32_t object_num,
                                                  const FontThingy &font,
                                                  int32_t subset,
                                                  int32_t font_descriptor_obj,
-                                                 int32_t tounicode_obj) {
+                                                 int32_t tounicode_obj,
+                                                 int32_t descendant_obj) {
     auto face = font.fontdata.face.get();
+    if(font.subsets.is_cid()) {
+        auto objbuf = std::format(R"(<<
+  /Type /Font
+  /Subtype /Type0
+  /BaseFont /{}
+  /Encoding /Identity-H
+  /DescendantFonts [ {} 0 R ]
+  /ToUnicode {} 0 R
+>>
+)",
+                                  subsetfontname2pdfname(FT_Get_Postscript_Name(face), subset),
+                                  descendant_obj,
+                                  tounicode_obj);
+        ERCV(write_finished_object(object_num, objbuf, ""));
+        return NoReturnValue{};
+    }
     const std::vector<TTGlyphs> &subset_glyphs = font.subsets.get_subset(subset);
     int32_t start_char = 0;
     int32_t end_char = subset_glyphs.size() - 1;
@@ -408,14 +835,61 @@ rvoe<NoReturnValue> PdfWriter::write_subset_font(int32_t object_num,
     return NoReturnValue{};
 }
 
+rvoe<NoReturnValue> PdfWriter::write_subset_cid_font(int32_t object_num,
+                                                     const FontThingy &font,
+                                                     int32_t subset,
+                                                     int32_t font_descriptor_obj) {
+    auto face = font.fontdata.face.get();
+    const std::vector<TTGlyphs> &subset_glyphs = font.subsets.get_subset(subset);
+    // Identity-H character codes are CIDs and CIDToGIDMap is identity,
+    // so the entries of the width array line up with the glyph order of
+    // the generated subset font.
+    ERC(width_arr, build_subset_width_array(face, subset_glyphs));
+    auto objbuf = std::format(R"(<<
+  /Type /Font
+  /Subtype /CIDFontType2
+  /BaseFont /{}
+  /CIDSystemInfo <<
+    /Registry (Adobe)
+    /Ordering (Identity)
+    /Supplement 0
+  >>
+  /FontDescriptor {} 0 R
+  /W [ 0 {} ]
+  /CIDToGIDMap /Identity
+>>
+)",
+                              subsetfontname2pdfname(FT_Get_Postscript_Name(face), subset),
+                              font_descriptor_obj,
+                              width_arr);
+    ERCV(write_finished_object(object_num, objbuf, ""));
+    return NoReturnValue{};
+}
+
 rvoe<NoReturnValue> PdfWriter::write_subset_font_data(int32_t object_num,
                                                       const DelayedSubsetFontData &ssfont) {
-    const auto &font = doc.fonts.at(ssfont.fid.id);
-    ERC(subset_font,
-        font.subsets.generate_subset(
-            font.fontdata.face.get(), font.fontdata.fontdata, ssfont.subset_id));
-
-    ERC(compressed_bytes, flate_compress(subset_font));
+    std::string compressed_bytes;
+    size_t uncompressed_size;
+    auto pf = prefinalized.find(object_num);
+    if(pf != prefinalized.end()) {
+        compressed_bytes = std::move(pf->second.compressed);
+        uncompressed_size = pf->second.uncompressed_size;
+    } else {
+        const auto &font = doc.fonts.at(ssfont.fid.id);
+        const auto subset_start = std::chrono::steady_clock::now();
+        ERC(subset_font,
+            font.subsets.generate_subset(
+                font.fontdata.face.get(), *font.fontdata.fontdata, ssfont.subset_id));
+        doc.stats.subset_seconds += seconds_since(subset_start);
+        const auto deflate_start = std::chrono::steady_clock::now();
+        ERC(compressed,
+            flate_compress(subset_font, doc.opts.num_threads, doc.opts.compression.font_level));
+        doc.stats.deflate_seconds += seconds_since(deflate_start);
+        compressed_bytes = std::move(compressed);
+        uncompressed_size = subset_font.size();
+        doc.stats.deflate_bytes_in[CAPY_STREAM_CLASS_FONT] += uncompressed_size;
+        doc.stats.deflate_bytes_out[CAPY_STREAM_CLASS_FONT] += compressed_bytes.size();
+    }
     std::string dictbuf = std::format(R"(<<
   /Length {}
   /Length1 {}
@@ -423,7 +897,7 @@ rvoe<NoReturnValue> PdfWriter::write_subset_font_data(int32_t object_num,
 >>
 )",
                                       compressed_bytes.size(),
-                                      subset_font.size());
+                                      uncompressed_size);
     ERCV(write_finished_object(object_num, dictbuf, compressed_bytes));
     return NoReturnValue{};
 }
@@ -465,7 +939,7 @@ void PdfWriter::write_subset_font_descriptor(int32_t object_num,
 
 rvoe<NoReturnValue>
 PdfWriter::write_subset_cmap(int32_t object_num, const FontThingy &font, int32_t subset_number) {
-    auto cmap = create_subset_cmap(font.subsets.get_subset(subset_number));
+    auto cmap = create_subset_cmap(font.subsets.get_subset(subset_number), font.subsets.is_cid());
     auto dict = std::format(R"(<<
   /Length {}
 >>
@@ -479,12 +953,31 @@ rvoe<NoReturnValue> PdfWriter::write_pages_root() {
     auto buf_append = std::back_inserter(buf);
     buf = std::format(R"(<<
   /Type /Pages
-  /Kids [
 )");
-    for(const auto &i : doc.pages) {
-        std::format_to(buf_append, "    {} 0 R\n", i.page_obj_num);
+    // The default media box is inheritable, so it only needs to be
+    // repeated on pages that override it.
+    write_rectangle(
+        buf, "MediaBox", *doc.opts.default_page_properties.mediabox, doc.opts.coordinate_precision);
+    buf += "  /Kids [\n";
+    size_t num_pages = doc.pages.size();
+    if(!doc.page_tree_root_kids.empty()) {
+        for(const auto &kid : doc.page_tree_root_kids) {
+            std::format_to(buf_append, "    {} 0 R\n", kid);
+        }
+    } else {
+        if(doc.incremental_base) {
+            // The update replaces the base page tree with one that lists
+            // the old pages followed by the newly generated ones.
+            for(const auto &kid : doc.incremental_base->page_kids) {
+                std::format_to(buf_append, "    {} 0 R\n", kid);
+            }
+            num_pages += doc.incremental_base->page_kids.size();
+        }
+        for(const auto &i : doc.pages) {
+            std::format_to(buf_append, "    {} 0 R\n", i.page_obj_num);
+        }
     }
-    std::format_to(buf_append, "  ]\n  /Count {}\n>>\n", doc.pages.size());
+    std::format_to(buf_append, "  ]\n  /Count {}\n>>\n", num_pages);
     return write_finished_object(doc.pages_object, buf, "");
 }
 
@@ -500,23 +993,27 @@ rvoe<NoReturnValue> PdfWriter::write_delayed_page(const DelayedPage &dp) {
   /Group {} 0 R
   /LastModified {}
 )",
-                   doc.pages_object,
+                   doc.page_parents.empty() ? doc.pages_object : doc.page_parents.at(dp.page_num),
                    doc.page_group_object,
                    current_date_string());
     PageProperties current_props = doc.opts.default_page_properties.merge_with(dp.custom_props);
-    write_rectangle(buf_append, "MediaBox", *current_props.mediabox);
+    const auto precision = doc.opts.coordinate_precision;
+    if(dp.custom_props.mediabox) {
+        // Otherwise the page inherits the default box from the tree root.
+        write_rectangle(buf, "MediaBox", *current_props.mediabox, precision);
+    }
 
     if(current_props.cropbox) {
-        write_rectangle(buf_append, "CropBox", *current_props.cropbox);
+        write_rectangle(buf, "CropBox", *current_props.cropbox, precision);
     }
     if(current_props.bleedbox) {
-        write_rectangle(buf_append, "BleedBox", *current_props.bleedbox);
+        write_rectangle(buf, "BleedBox", *current_props.bleedbox, precision);
     }
     if(current_props.trimbox) {
-        write_rectangle(buf_append, "TrimBox", *current_props.trimbox);
+        write_rectangle(buf, "TrimBox", *current_props.trimbox, precision);
     }
     if(current_props.artbox) {
-        write_rectangle(buf_append, "ArtBox", *current_props.artbox);
+        write_rectangle(buf, "ArtBox", *current_props.artbox, precision);
     }
     if(dp.structparents) {
         std::format_to(buf_append, "  /StructParents {}\n", dp.structparents.value());
@@ -625,17 +1122,14 @@ rvoe<NoReturnValue> PdfWriter::write_annotation(int obj_num, const DelayedAnnota
 )",
                        doc.embedded_files[faa->fileid.id].filespec_obj);
     } else if(auto ua = std::get_if<UriAnnotation>(&annotation.a.sub)) {
-        auto uri_as_str = pdfstring_quote(ua->uri.sv());
+        const auto action_obj = doc.uri_action_dedup.at(hash_bytes(ua->uri.sv()));
         std::format_to(app,
                        R"(  /Subtype /Link
   /Contents {}
-  /A <<
-    /S /URI
-    /URI {}
-  >>
+  /A {} 0 R
 )",
-                       uri_as_str,
-                       uri_as_str);
+                       pdfstring_quote(ua->uri.sv()),
+                       action_obj);
     } else if(auto sa = std::get_if<ScreenAnnotation>(&annotation.a.sub)) {
         int32_t media_filespec = doc.embedded_files.at(sa->mediafile.id).filespec_obj;
         if(!sa->times) {
@@ -717,7 +1211,6 @@ rvoe<NoReturnValue> PdfWriter::write_annotation(int obj_num, const DelayedAnnota
 
 rvoe<NoReturnValue> PdfWriter::write_delayed_structure_item(int obj_num,
                                                             const DelayedStructItem &dsi) {
-    std::vector<CapyPDF_StructureItemId> children;
     const auto &si = doc.structure_items.at(dsi.sid.id);
     assert(doc.structure_root_object);
     int32_t parent_object = *doc.structure_root_object;
@@ -725,15 +1218,17 @@ rvoe<NoReturnValue> PdfWriter::write_delayed_structure_item(int obj_num,
         parent_object = doc.structure_items.at(si.parent->id).obj_id;
     }
 
-    // Yes, this is O(n^2). I got lazy.
-    for(int32_t i = 0; i < (int32_t)doc.structure_items.size(); ++i) {
-        if(doc.structure_items[i].parent) {
-            auto current_parent = doc.structure_items.at(doc.structure_items[i].parent->id).obj_id;
-            if(current_parent == si.obj_id) {
-                children.emplace_back(CapyPDF_StructureItemId{i});
+    if(structure_children.size() != doc.structure_items.size()) {
+        // Group items by parent once instead of rescanning the item
+        // array for every element.
+        structure_children.assign(doc.structure_items.size(), {});
+        for(int32_t i = 0; i < (int32_t)doc.structure_items.size(); ++i) {
+            if(doc.structure_items[i].parent) {
+                structure_children[doc.structure_items[i].parent->id].push_back(i);
             }
         }
     }
+    const auto &children = structure_children.at(dsi.sid.id);
     std::string dict = R"(<<
   /Type /StructElem
 )";
@@ -755,7 +1250,7 @@ rvoe<NoReturnValue> PdfWriter::write_delayed_structure_item(int obj_num,
     if(!children.empty()) {
         dict += "  /K [\n";
         for(const auto &c : children) {
-            std::format_to(app, "    {} 0 R\n", doc.structure_items.at(c.id).obj_id);
+            std::format_to(app, "    {} 0 R\n", doc.structure_items.at(c).obj_id);
         }
         dict += "  ]\n";
     } else {
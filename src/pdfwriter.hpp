@@ -5,31 +5,64 @@
 
 #include <pdfdocument.hpp>
 
+#include <unordered_map>
+
 namespace capypdf {
 
 class PdfWriter {
 public:
     explicit PdfWriter(PdfDocument &doc);
+    ~PdfWriter();
     rvoe<NoReturnValue> write_to_file(const std::filesystem::path &ofilename);
 
+    // Writes the document by handing its bytes to the given callback
+    // in large chunks instead of opening a file. The callback can
+    // append to a memory buffer, write to a file descriptor etc.
+    rvoe<NoReturnValue> write_to_sink(CapyPDF_Write_Sink_Callback cb, void *ctx);
+
+    // Streamed writes. The output file is opened up front and finished
+    // objects are written to it as soon as they are added.
+    rvoe<NoReturnValue> begin_streaming(const std::filesystem::path &ofilename);
+    rvoe<int64_t> write_streamed_object(int32_t object_number,
+                                        std::string_view dict_data,
+                                        std::string_view stream_data);
+
 private:
     rvoe<NoReturnValue> write_to_file(FILE *output_file);
     rvoe<NoReturnValue> write_to_file_impl();
 
+    // All output goes through a user space buffer so that the sink
+    // only sees a few large writes per document instead of several
+    // small ones per object.
     rvoe<NoReturnValue> write_bytes(const char *buf,
                                     size_t buf_size); // With error checking.
     rvoe<NoReturnValue> write_bytes(std::string_view view) {
         return write_bytes(view.data(), view.size());
     }
+    rvoe<NoReturnValue> flush_output_buffer();
+    // Writes to the underlying sink directly, bypassing the buffer.
+    rvoe<NoReturnValue> sink_write(const char *buf, size_t buf_size);
+    // The number of bytes written so far. Can not use ftell, because
+    // some of the output may still sit in the buffer and the sink
+    // might not even be a file.
+    int64_t current_offset() const { return bytes_flushed + (int64_t)output_buffer.size(); }
 
     rvoe<std::vector<uint64_t>> write_objects();
 
+    // Computes the expensive delayed streams (font subset generation and
+    // stream compression) in a worker pool before the sequential object
+    // write pass. A no-op unless the num_threads option enables threading.
+    rvoe<NoReturnValue> prefinalize_delayed_objects();
+
     rvoe<NoReturnValue> write_header();
     rvoe<NoReturnValue> write_cross_reference_table(const std::vector<uint64_t> &object_offsets);
     rvoe<NoReturnValue> write_trailer(int64_t xref_offset);
+    rvoe<NoReturnValue> write_object_streams_and_xref(const std::vector<uint64_t> &object_offsets);
     rvoe<NoReturnValue> write_finished_object(int32_t object_number,
                                               std::string_view dict_data,
                                               std::string_view stream_data);
+    rvoe<NoReturnValue> write_deflated_mapped_object(int32_t object_number,
+                                                     const DeflateMappedFilePDFObject &pobj);
     rvoe<NoReturnValue> write_subset_font_data(int32_t object_num,
                                                const DelayedSubsetFontData &ssfont);
     void write_subset_font_descriptor(int32_t object_num,
@@ -42,7 +75,12 @@ private:
                                           const FontThingy &font,
                                           int32_t subset,
                                           int32_t font_descriptor_obj,
-                                          int32_t tounicode_obj);
+                                          int32_t tounicode_obj,
+                                          int32_t descendant_obj);
+    rvoe<NoReturnValue> write_subset_cid_font(int32_t object_num,
+                                              const FontThingy &font,
+                                              int32_t subset,
+                                              int32_t font_descriptor_obj);
     rvoe<NoReturnValue> write_pages_root();
     rvoe<NoReturnValue> write_delayed_page(const DelayedPage &p);
     rvoe<NoReturnValue> write_checkbox_widget(int obj_num,
@@ -50,8 +88,31 @@ private:
     rvoe<NoReturnValue> write_annotation(int obj_num, const DelayedAnnotation &annotation);
     rvoe<NoReturnValue> write_delayed_structure_item(int obj_num, const DelayedStructItem &p);
 
+    struct PrefinalizedStream {
+        std::string compressed;
+        size_t uncompressed_size;
+    };
+
+    static constexpr size_t output_buffer_capacity = 1024 * 1024;
+
     PdfDocument &doc;
+    std::unordered_map<int32_t, PrefinalizedStream> prefinalized;
+    // Compressed sizes of chunk-deflated streams, filled in as they
+    // are written and consumed by their DelayedStreamLength objects.
+    std::unordered_map<int32_t, uint64_t> stream_lengths;
+    // Child item indices of every structure item, built on first use.
+    std::vector<std::vector<int32_t>> structure_children;
     FILE *ofile = nullptr;
+    // Set instead of ofile when writing to a caller-supplied sink.
+    CapyPDF_Write_Sink_Callback sink_cb = nullptr;
+    void *sink_ctx = nullptr;
+    std::string output_buffer;
+    int64_t bytes_flushed = 0;
+    // Non-stream objects waiting to be packed into object streams.
+    std::vector<std::pair<int32_t, std::string>> objstm_pending;
+    // Nonempty when streaming. Cleaned up by the destructor
+    // if generation is aborted before the document is written.
+    std::filesystem::path streaming_tempfile;
 };
 
 } // namespace capypdf
@@ -3,6 +3,9 @@
 
 #include <utils.hpp>
 #include <zlib.h>
+#ifdef CAPYPDF_HAS_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include <cassert>
 #include <cstring>
 #ifdef _WIN32
@@ -10,11 +13,18 @@
 #include <windows.h>
 #else
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <charconv>
 #include <format>
 #include <memory>
 #include <random>
+#include <thread>
 
 namespace capypdf {
 
@@ -86,9 +96,243 @@ bool needs_quoting(const unsigned char c) {
     return false;
 }
 
+// SWAR helpers for scanning text eight bytes at a time. Portable
+// across architectures unlike SSE/NEON intrinsics, and the compiler
+// vectorizes the word loop further where it can.
+
+const uint64_t swar_ones = 0x0101010101010101ULL;
+const uint64_t swar_highs = 0x8080808080808080ULL;
+
+// Nonzero iff some byte of v is zero.
+uint64_t swar_has_zero_byte(uint64_t v) { return (v - swar_ones) & ~v & swar_highs; }
+
+// Nonzero iff some byte of v equals c.
+uint64_t swar_has_byte(uint64_t v, unsigned char c) {
+    return swar_has_zero_byte(v ^ (swar_ones * c));
+}
+
+// Nonzero iff some byte of v is below bound. Only valid when no byte
+// of v has its high bit set.
+uint64_t swar_has_byte_below(uint64_t v, unsigned char bound) {
+    return (v - swar_ones * bound) & ~v & swar_highs;
+}
+
+// The number of bytes starting at offset that are plain ASCII.
+size_t ascii_prefix_length(std::string_view input, size_t offset) {
+    size_t i = offset;
+    while(i + sizeof(uint64_t) <= input.size()) {
+        uint64_t word;
+        memcpy(&word, input.data() + i, sizeof(word));
+        if(word & swar_highs) {
+            break;
+        }
+        i += sizeof(uint64_t);
+    }
+    while(i < input.size() && (unsigned char)input[i] < 0x80) {
+        ++i;
+    }
+    return i - offset;
+}
+
+// The number of bytes starting at offset that do not need name quoting.
+size_t unquoted_prefix_length(std::string_view input, size_t offset) {
+    size_t i = offset;
+    while(i + sizeof(uint64_t) <= input.size()) {
+        uint64_t word;
+        memcpy(&word, input.data() + i, sizeof(word));
+        if(word & swar_highs) {
+            break;
+        }
+        if(swar_has_byte_below(word, '!') | swar_has_byte(word, '~' + 1) |
+           swar_has_byte(word, '#') | swar_has_byte(word, '(') | swar_has_byte(word, ')') |
+           swar_has_byte(word, '/')) {
+            break;
+        }
+        i += sizeof(uint64_t);
+    }
+    while(i < input.size() && !needs_quoting((unsigned char)input[i])) {
+        ++i;
+    }
+    return i - offset;
+}
+
+// The number of bytes starting at offset that do not need escaping in
+// a PDF string literal.
+size_t unescaped_prefix_length(std::string_view input, size_t offset) {
+    size_t i = offset;
+    while(i + sizeof(uint64_t) <= input.size()) {
+        uint64_t word;
+        memcpy(&word, input.data() + i, sizeof(word));
+        if(swar_has_byte(word, '(') | swar_has_byte(word, ')') | swar_has_byte(word, '\\')) {
+            break;
+        }
+        i += sizeof(uint64_t);
+    }
+    while(i < input.size()) {
+        const char c = input[i];
+        if(c == '(' || c == ')' || c == '\\') {
+            break;
+        }
+        ++i;
+    }
+    return i - offset;
+}
+
+const size_t DEFLATE_CHUNK_SIZE = 1024 * 1024;
+
+struct DeflatedChunk {
+    std::string compressed;
+    uLong adler = 0;
+    ErrorCode ec = ErrorCode::NoError;
+};
+
+// The FLEVEL byte of the zlib header as deflateInit would write it.
+char zlib_header_flags(int32_t level) {
+    if(level >= 7) {
+        return '\xda';
+    }
+    if(level == 6) {
+        return '\x9c';
+    }
+    if(level >= 2) {
+        return '\x5e';
+    }
+    return '\x01';
+}
+
+// Compresses one chunk as a raw deflate stream. All chunks except the
+// last one end with a full flush, so the results can be concatenated
+// into a single valid deflate stream.
+void deflate_one_chunk(std::string_view chunk, bool is_last, int32_t level, DeflatedChunk &out) {
+    const int BUFBLOCK = 256 * 1024;
+    std::string buf;
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+
+    if(deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        out.ec = ErrorCode::CompressionFailure;
+        return;
+    }
+    std::unique_ptr<z_stream, int (*)(z_stream *)> zcloser(&strm, deflateEnd);
+    strm.avail_in = chunk.size();
+    strm.next_in = (Bytef *)(chunk.data()); // Very unsafe.
+    const int flushmode = is_last ? Z_FINISH : Z_FULL_FLUSH;
+    int ret;
+    do {
+        buf.resize(BUFBLOCK);
+        strm.avail_out = BUFBLOCK;
+        strm.next_out = (Bytef *)buf.data();
+        ret = deflate(&strm, flushmode);
+        assert(ret != Z_STREAM_ERROR);
+        buf.resize(BUFBLOCK - strm.avail_out);
+        out.compressed += buf;
+    } while(strm.avail_out == 0);
+    if(strm.avail_in != 0 || (is_last && ret != Z_STREAM_END)) {
+        out.ec = ErrorCode::CompressionFailure;
+        return;
+    }
+    out.adler = adler32(adler32(0L, Z_NULL, 0), (const Bytef *)chunk.data(), chunk.size());
+}
+
+rvoe<std::string>
+flate_compress_parallel(std::string_view data, uint32_t num_threads, int32_t level) {
+    const size_t num_chunks = (data.size() + DEFLATE_CHUNK_SIZE - 1) / DEFLATE_CHUNK_SIZE;
+    num_threads = std::min(num_threads, (uint32_t)num_chunks);
+    std::vector<DeflatedChunk> results(num_chunks);
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads);
+    for(uint32_t tid = 0; tid < num_threads; ++tid) {
+        workers.emplace_back([tid, num_threads, num_chunks, data, level, &results]() {
+            for(size_t i = tid; i < num_chunks; i += num_threads) {
+                const auto chunk = data.substr(i * DEFLATE_CHUNK_SIZE, DEFLATE_CHUNK_SIZE);
+                deflate_one_chunk(chunk, i == num_chunks - 1, level, results[i]);
+            }
+        });
+    }
+    for(auto &w : workers) {
+        w.join();
+    }
+    std::string compressed;
+    compressed += '\x78';
+    compressed += zlib_header_flags(level);
+    uLong adler = adler32(0L, Z_NULL, 0);
+    size_t bytes_processed = 0;
+    for(const auto &r : results) {
+        if(r.ec != ErrorCode::NoError) {
+            return std::unexpected(r.ec);
+        }
+        compressed += r.compressed;
+        const auto chunk_size = std::min(DEFLATE_CHUNK_SIZE, data.size() - bytes_processed);
+        adler = adler32_combine(adler, r.adler, chunk_size);
+        bytes_processed += chunk_size;
+    }
+    for(int shift = 24; shift >= 0; shift -= 8) {
+        compressed += (char)((adler >> shift) & 0xff);
+    }
+    return std::move(compressed);
+}
+
 } // namespace
 
-rvoe<std::string> flate_compress(std::string_view data) {
+rvoe<uint64_t> flate_compress_to(std::string_view data,
+                                 int32_t level,
+                                 const std::function<rvoe<NoReturnValue>(std::string_view)> &sink) {
+    uint64_t bytes_written = 0;
+    const char header[2] = {'\x78', zlib_header_flags(level)};
+    ERCV(sink(std::string_view{header, 2}));
+    bytes_written += 2;
+    // Z_FINISH must be issued even for empty input to get a valid
+    // stream, so always process at least one chunk.
+    const size_t num_chunks =
+        std::max<size_t>(1, (data.size() + DEFLATE_CHUNK_SIZE - 1) / DEFLATE_CHUNK_SIZE);
+    uLong adler = adler32(0L, Z_NULL, 0);
+    DeflatedChunk result;
+    for(size_t i = 0; i < num_chunks; ++i) {
+        const auto chunk = data.substr(i * DEFLATE_CHUNK_SIZE, DEFLATE_CHUNK_SIZE);
+        result.compressed.clear();
+        deflate_one_chunk(chunk, i == num_chunks - 1, level, result);
+        if(result.ec != ErrorCode::NoError) {
+            return std::unexpected(result.ec);
+        }
+        ERCV(sink(result.compressed));
+        bytes_written += result.compressed.size();
+        adler = adler32_combine(adler, result.adler, chunk.size());
+    }
+    char trailer[4];
+    for(int i = 0; i < 4; ++i) {
+        trailer[i] = (char)((adler >> (24 - 8 * i)) & 0xff);
+    }
+    ERCV(sink(std::string_view{trailer, 4}));
+    bytes_written += 4;
+    return bytes_written;
+}
+
+rvoe<std::string> flate_compress(std::string_view data, uint32_t num_threads, int32_t level) {
+    if(num_threads == 0) {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    if(num_threads > 1 && data.size() > DEFLATE_CHUNK_SIZE) {
+        return flate_compress_parallel(data, num_threads, level);
+    }
+#ifdef CAPYPDF_HAS_LIBDEFLATE
+    // One shot whole buffer compression through libdeflate, which is
+    // considerably faster than zlib at the same level.
+    std::unique_ptr<libdeflate_compressor, void (*)(libdeflate_compressor *)> comp(
+        libdeflate_alloc_compressor(level), libdeflate_free_compressor);
+    if(!comp) {
+        RETERR(CompressionFailure);
+    }
+    std::string out(libdeflate_zlib_compress_bound(comp.get(), data.size()), '\0');
+    const auto written =
+        libdeflate_zlib_compress(comp.get(), data.data(), data.size(), out.data(), out.size());
+    if(written == 0) {
+        RETERR(CompressionFailure);
+    }
+    out.resize(written);
+    return std::move(out);
+#else
     std::string compressed;
     const int CHUNK = 1024 * 1024;
     std::string buf;
@@ -97,7 +341,7 @@ rvoe<std::string> flate_compress(std::string_view data) {
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
 
-    auto ret = deflateInit(&strm, Z_BEST_COMPRESSION);
+    auto ret = deflateInit(&strm, level);
     if(ret != Z_OK) {
         RETERR(CompressionFailure);
     }
@@ -125,6 +369,23 @@ rvoe<std::string> flate_compress(std::string_view data) {
     }
 
     return std::move(compressed);
+#endif
+}
+
+bool worth_compressing(std::string_view data) {
+    const size_t sample_size = 64 * 1024;
+    if(data.size() <= 1024) {
+        // Compressing small streams costs nothing either way.
+        return true;
+    }
+    const auto sample = data.substr(0, sample_size);
+    auto compressed = flate_compress(sample, 1, 1);
+    if(!compressed) {
+        return true;
+    }
+    // Require at least ~1.5% savings on the sample, anything less is
+    // noise that level 9 will not meaningfully improve on.
+    return compressed->size() < sample.size() - sample.size() / 64;
 }
 
 rvoe<std::string> load_file(const char *fname) {
@@ -157,6 +418,67 @@ rvoe<std::string> load_file(FILE *f) {
     return contents;
 }
 
+void MappedFile::unmap() {
+#ifndef _WIN32
+    if(map_addr) {
+        munmap((void *)map_addr, map_size);
+    }
+#endif
+    map_addr = nullptr;
+    map_size = 0;
+}
+
+MappedFile::~MappedFile() { unmap(); }
+
+MappedFile &MappedFile::operator=(MappedFile &&o) noexcept {
+    if(this != &o) {
+        unmap();
+        map_addr = o.map_addr;
+        map_size = o.map_size;
+        fallback = std::move(o.fallback);
+        o.map_addr = nullptr;
+        o.map_size = 0;
+    }
+    return *this;
+}
+
+rvoe<MappedFile> MappedFile::map(const std::filesystem::path &fname) {
+    if(!std::filesystem::is_regular_file(fname)) {
+        RETERR(FileDoesNotExist);
+    }
+    MappedFile mf;
+#ifdef _WIN32
+    ERC(contents, load_file(fname));
+    mf.fallback = std::move(contents);
+#else
+    int fd = open(fname.string().c_str(), O_RDONLY);
+    if(fd < 0) {
+        perror(nullptr);
+        RETERR(CouldNotOpenFile);
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        perror(nullptr);
+        close(fd);
+        RETERR(FileReadError);
+    }
+    if(st.st_size == 0) {
+        // Zero length mappings are not permitted.
+        close(fd);
+        return mf;
+    }
+    auto *addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        perror(nullptr);
+        RETERR(FileReadError);
+    }
+    mf.map_addr = (const char *)addr;
+    mf.map_size = (size_t)st.st_size;
+#endif
+    return mf;
+}
+
 void write_file(const char *ofname, const char *buf, size_t bufsize) {
     FILE *f = fopen(ofname, "w");
     if(!f) {
@@ -189,7 +511,6 @@ std::string utf8_to_pdfutf16be(const u8string &input, bool add_adornments) {
 }
 
 bool is_valid_utf8(std::string_view input) {
-    std::vector<uint32_t> glyphs;
     UtfDecodeStep par;
     // clang-format off
     const uint32_t twobyte_header_mask    = 0b11100000;
@@ -200,11 +521,13 @@ bool is_valid_utf8(std::string_view input) {
     const uint32_t fourbyte_header_value  = 0b11110000;
     // clang-format on
     for(size_t i = 0; i < input.size(); ++i) {
+        // Skip over ASCII runs a word at a time.
+        i += ascii_prefix_length(input, i);
+        if(i >= input.size()) {
+            break;
+        }
         const uint32_t code = uint32_t((unsigned char)input[i]);
-        if(code < 0x80) {
-            glyphs.push_back(code);
-            continue;
-        } else if((code & twobyte_header_mask) == twobyte_header_value) {
+        if((code & twobyte_header_mask) == twobyte_header_value) {
             par.byte1_data_mask = 0b11111;
             par.num_subsequent_bytes = 1;
         } else if((code & threebyte_header_mask) == threebyte_header_value) {
@@ -250,31 +573,23 @@ std::string pdfstring_quote(std::string_view raw_string) {
     std::string result;
     result.reserve(raw_string.size() * 2 + 2);
     result.push_back('(');
-    for(const char c : raw_string) {
-        switch(c) {
-        case '(':
-        case ')':
-        case '\\':
-            result.push_back('\\');
-            break;
-        default:
+    for(size_t i = 0; i < raw_string.size();) {
+        // Copy runs that need no escaping in one go.
+        const auto run = unescaped_prefix_length(raw_string, i);
+        result.append(raw_string.substr(i, run));
+        i += run;
+        if(i >= raw_string.size()) {
             break;
         }
-        result.push_back(c);
+        result.push_back('\\');
+        result.push_back(raw_string[i]);
+        ++i;
     }
     result.push_back(')');
     return result;
 }
 
-bool is_ascii(std::string_view text) {
-    for(const auto c : text) {
-        auto ci = int32_t((unsigned char)c);
-        if(ci > 127) {
-            return false;
-        }
-    }
-    return true;
-}
+bool is_ascii(std::string_view text) { return ascii_prefix_length(text, 0) == text.size(); }
 
 // As in PDF 2.0 spec 7.3.5
 std::string bytes2pdfstringliteral(std::string_view raw, bool add_slash) {
@@ -284,20 +599,55 @@ std::string bytes2pdfstringliteral(std::string_view raw, bool add_slash) {
     if(add_slash) {
         result.push_back('/');
     }
-    for(const unsigned char c : raw) {
-        if(needs_quoting(c)) {
-            result += '#';
-            if(snprintf(buf, 10, "%02x", (unsigned int)c) != 2) {
-                std::abort();
-            }
-            result += buf;
-        } else {
-            result += c;
+    for(size_t i = 0; i < raw.size();) {
+        // Copy runs that need no quoting in one go.
+        const auto run = unquoted_prefix_length(raw, i);
+        result.append(raw.substr(i, run));
+        i += run;
+        if(i >= raw.size()) {
+            break;
         }
+        const unsigned char c = raw[i];
+        result += '#';
+        if(snprintf(buf, 10, "%02x", (unsigned int)c) != 2) {
+            std::abort();
+        }
+        result += buf;
+        ++i;
     }
     return result;
 }
 
+void append_coord(std::string &buf, double value, int32_t precision) {
+    precision = std::clamp(precision, 0, 17);
+    char tmp[64];
+    auto res = std::to_chars(tmp, tmp + sizeof(tmp), value, std::chars_format::fixed, precision);
+    if(res.ec != std::errc{}) {
+        // Fall back for values that do not fit in fixed notation.
+        std::format_to(std::back_inserter(buf), "{:f}", value);
+        return;
+    }
+    const char *end = res.ptr;
+    if(precision > 0) {
+        while(end > tmp && end[-1] == '0') {
+            --end;
+        }
+        if(end > tmp && end[-1] == '.') {
+            --end;
+        }
+    }
+    buf.append(tmp, end);
+}
+
+uint64_t hash_bytes(std::string_view data, uint64_t seed) {
+    uint64_t h = seed;
+    for(const unsigned char c : data) {
+        h ^= c;
+        h *= UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+
 std::string create_trailer_id() {
     int num_bytes = 16;
     std::string msg;
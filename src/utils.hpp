@@ -7,9 +7,11 @@
 #include <pdfcommon.hpp>
 #include <string>
 #include <expected>
+#include <chrono>
 #include <cstdio>
 #include <string_view>
 #include <filesystem>
+#include <functional>
 #include <vector>
 
 namespace capypdf {
@@ -22,7 +24,27 @@ template<class... Ts> struct overloaded : Ts... {
 template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 #endif
 
-rvoe<std::string> flate_compress(std::string_view data);
+// num_threads > 1 splits the input into chunks that are deflated in a
+// worker pool and stitched back together in order. Zero means using
+// all hardware threads. The level is the zlib 1-9 scale.
+rvoe<std::string> flate_compress(std::string_view data, uint32_t num_threads = 1, int32_t level = 9);
+
+// Deflates the input into the sink one chunk at a time, so peak
+// memory use is bounded by the chunk size instead of the size of the
+// compressed result. Returns the total number of bytes handed to the
+// sink.
+rvoe<uint64_t> flate_compress_to(std::string_view data,
+                                 int32_t level,
+                                 const std::function<rvoe<NoReturnValue>(std::string_view)> &sink);
+
+// Deflates a small sample to detect data that does not compress
+// (random or already dense bytes) so full compression can be skipped.
+bool worth_compressing(std::string_view data);
+
+// For phase timing statistics.
+inline double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
 
 rvoe<std::string> load_file(const char *fname);
 
@@ -30,6 +52,32 @@ rvoe<std::string> load_file(const std::filesystem::path &fname);
 
 rvoe<std::string> load_file(FILE *f);
 
+// A read only file memory mapped into the address space. Ingesting large
+// fonts and attachments this way avoids copying their bytes to the heap.
+// On platforms without mmap the contents are read into memory instead.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(MappedFile &&o) noexcept { *this = std::move(o); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(MappedFile &&o) noexcept;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    static rvoe<MappedFile> map(const std::filesystem::path &fname);
+
+    std::string_view sv() const {
+        return map_addr ? std::string_view{map_addr, map_size} : std::string_view{fallback};
+    }
+
+private:
+    void unmap();
+
+    const char *map_addr = nullptr;
+    size_t map_size = 0;
+    std::string fallback;
+};
+
 void write_file(const char *ofname, const char *buf, size_t bufsize);
 
 std::string utf8_to_pdfutf16be(const u8string &input, bool add_adornments = true);
@@ -46,6 +94,30 @@ std::string bytes2pdfstringliteral(std::string_view raw, bool add_slash = true);
 
 std::string create_trailer_id();
 
+// 64 bit FNV-1a. A fast non-cryptographic hash used to key resource
+// deduplication caches. Passing a previous result as the seed chains
+// several buffers into a single hash.
+uint64_t hash_bytes(std::string_view data, uint64_t seed = 0xcbf29ce484222325UL);
+
+// Fast fixed notation double serializer for content streams. Writes at
+// most `precision` decimals and trims trailing zeros, so 100.0 comes
+// out as "100" instead of "100.000000".
+void append_coord(std::string &buf, double value, int32_t precision);
+
+// Appends the indent, the given coordinates separated by spaces and the
+// operator name followed by a newline.
+template<typename... T>
+void append_coord_cmd(std::string &buf,
+                      std::string_view indent,
+                      int32_t precision,
+                      std::string_view op,
+                      T... coords) {
+    buf += indent;
+    ((append_coord(buf, coords, precision), buf += ' '), ...);
+    buf += op;
+    buf += '\n';
+}
+
 void serialize_trans(std::back_insert_iterator<std::string> buf_append,
                      const Transition &t,
                      std::string_view indent);
@@ -32,6 +32,19 @@ def draw_intersect_shape(ctx):
     ctx.cmd_l(20, 10)
     ctx.cmd_h()
 
+def extract_idat(pngfile):
+    import struct
+    data = pngfile.read_bytes()
+    idat = b''
+    offset = 8
+    while offset + 12 <= len(data):
+        (chunk_size,) = struct.unpack('>I', data[offset:offset+4])
+        chunk_type = data[offset+4:offset+8]
+        if chunk_type == b'IDAT':
+            idat += data[offset+8:offset+8+chunk_size]
+        offset += chunk_size + 12
+    return idat
+
 def validate_image(basename, w, h):
     import functools
     def decorator_validate(func):
@@ -140,6 +153,463 @@ class TestPDFCreation(unittest.TestCase):
                 ctx.cmd_j(capypdf.LineJoinStyle.Bevel)
         ofile.unlink()
 
+    def test_num_threads(self):
+        ofile = pathlib.Path('threaded.pdf')
+        opts = capypdf.Options()
+        opts.set_num_threads(0)
+        with capypdf.Generator(ofile, opts) as g:
+            ib = capypdf.RasterImageBuilder()
+            ib.set_size(1024, 512)
+            ib.set_pixel_data(bytes(1024*512*3))
+            image = ib.build()
+            iid = g.add_image(image, capypdf.ImagePdfProperties())
+            with g.page_draw_context() as ctx:
+                with ctx.push_gstate():
+                    ctx.translate(10, 10)
+                    ctx.scale(100, 100)
+                    ctx.draw_image(iid)
+        ofile.unlink()
+
+    def test_streamed_writes(self):
+        ofile = pathlib.Path('streamed.pdf')
+        opts = capypdf.Options()
+        opts.set_streamed_writes(True)
+        with capypdf.Generator(ofile, opts) as g:
+            ib = capypdf.RasterImageBuilder()
+            ib.set_size(16, 16)
+            ib.set_pixel_data(bytes(16*16*3))
+            image = ib.build()
+            iid = g.add_image(image, capypdf.ImagePdfProperties())
+            with g.page_draw_context() as ctx:
+                with ctx.push_gstate():
+                    ctx.translate(10, 10)
+                    ctx.scale(100, 100)
+                    ctx.draw_image(iid)
+        self.assertTrue(ofile.exists())
+        ofile.unlink()
+
+    def test_parallel_image_load(self):
+        ofile = pathlib.Path('parimages.pdf')
+        opts = capypdf.Options()
+        opts.set_num_threads(0)
+        with capypdf.Generator(ofile, opts) as g:
+            images = g.load_images([image_dir / '1bit_noalpha.png',
+                                    image_dir / 'comic-lines.png'])
+            self.assertEqual(len(images), 2)
+            params = capypdf.ImagePdfProperties()
+            iids = [g.add_image(i, params) for i in images]
+            with g.page_draw_context() as ctx:
+                for iid in iids:
+                    ctx.draw_image(iid)
+        self.assertTrue(ofile.exists())
+        ofile.unlink()
+
+    def test_borrowed_pixels(self):
+        ofile = pathlib.Path('borrowed.pdf')
+        with capypdf.Generator(ofile) as g:
+            ib = capypdf.RasterImageBuilder()
+            ib.set_size(16, 16)
+            ib.borrow_pixel_data(bytes(16*16*3))
+            image = ib.build()
+            iid = g.add_image(image, capypdf.ImagePdfProperties())
+            with g.page_draw_context() as ctx:
+                with ctx.push_gstate():
+                    ctx.translate(10, 10)
+                    ctx.scale(100, 100)
+                    ctx.draw_image(iid)
+        self.assertTrue(ofile.exists())
+        ofile.unlink()
+
+    def test_batched_paths(self):
+        ofile = pathlib.Path('batchedpath.pdf')
+        with capypdf.Generator(ofile) as g:
+            with g.page_draw_context() as ctx:
+                ctx.draw_polyline([10, 10,
+                                   50, 90,
+                                   90, 10])
+                ctx.cmd_S()
+                ctx.draw_path([100, 10,
+                               150, 10,
+                               150, 60, 125, 85, 100, 60],
+                              [capypdf.PathOperator.Move,
+                               capypdf.PathOperator.Line,
+                               capypdf.PathOperator.Curve,
+                               capypdf.PathOperator.Close])
+                ctx.cmd_f()
+                with self.assertRaises(capypdf.CapyPDFException):
+                    ctx.draw_polyline([1])
+        ofile.unlink()
+
+    def test_path_builder(self):
+        ofile = pathlib.Path('pathbuilder.pdf')
+        with capypdf.Generator(ofile) as g:
+            with g.page_draw_context() as ctx:
+                pb = capypdf.PathBuilder()
+                pb.cmd_m(100, 10)
+                pb.cmd_l(150, 10)
+                pb.cmd_c(150, 60, 125, 85, 100, 60)
+                pb.cmd_h()
+                ctx.draw_path_builder(pb)
+                ctx.cmd_f()
+                with self.assertRaises(capypdf.CapyPDFException):
+                    ctx.draw_path_builder([1, 2])
+        ofile.unlink()
+
+    def test_bulk_shading(self):
+        ofile = pathlib.Path('bulkshading.pdf')
+        with capypdf.Generator(ofile) as g:
+            sh4 = capypdf.Type4Shading(capypdf.DeviceColorspace.RGB, 0, 0, 100, 100)
+            sh4.add_triangles([50, 90,
+                               10, 10,
+                               90, 10,
+                               50, 10,
+                               10, 90,
+                               90, 90],
+                              [1, 0, 0,
+                               0, 1, 0,
+                               0, 0, 1,
+                               1, 0, 0,
+                               0, 1, 0,
+                               0, 0, 1])
+            with self.assertRaises(capypdf.CapyPDFException):
+                sh4.add_triangles([10, 10, 90, 10, 50, 90], [1, 0, 0])
+            sh4id = g.add_type4_shading(sh4)
+
+            sh6 = capypdf.Type6Shading(capypdf.DeviceColorspace.Gray, 0, 0, 100, 100)
+            sh6_coords = [10, 10,
+                          30, 0,
+                          60, 20,
+                          90, 10,
+                          100, 30,
+                          80, 60,
+                          90, 90,
+                          60, 100,
+                          30, 80,
+                          10, 90,
+                          0, 60,
+                          20, 30]
+            sh6.add_patches(sh6_coords, [0.0, 0.3, 0.6, 1.0])
+            sh6id = g.add_type6_shading(sh6)
+            with g.page_draw_context() as ctx:
+                ctx.cmd_sh(sh4id)
+                ctx.cmd_sh(sh6id)
+        ofile.unlink()
+
+    def test_parent_tree_fanout(self):
+        # Enough marked pages that the parent tree needs several leaves.
+        ofile = pathlib.Path('parenttree.pdf')
+        opt = capypdf.Options()
+        opt.set_tagged(True)
+        with capypdf.Generator(ofile, opt) as g:
+            doc_id = g.add_structure_item(capypdf.StructureType.Document)
+            for i in range(70):
+                with g.page_draw_context() as ctx:
+                    with ctx.cmd_BDC_builtin(g.add_structure_item(capypdf.StructureType.P, doc_id)):
+                        ctx.cmd_re(10, 10, 80, 80)
+                        ctx.cmd_f()
+        contents = ofile.read_bytes()
+        self.assertTrue(b'/ParentTree' in contents)
+        self.assertTrue(b'/Limits' in contents)
+        ofile.unlink()
+
+    def test_shared_resource_dict(self):
+        # Pages with the same resource set share one /Resources object.
+        ofile = pathlib.Path('sharedresources.pdf')
+        with capypdf.Generator(ofile) as g:
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            for i in range(3):
+                with g.page_draw_context() as ctx:
+                    ctx.render_text('Same resources on every page.', fid, 12, 50, 150)
+        contents = ofile.read_bytes()
+        self.assertEqual(contents.count(b'/SFont'), 1)
+        ofile.unlink()
+
+    def test_generator_clone(self):
+        # A prepared generator can be cloned so batch jobs load fonts
+        # only once. Resource ids remain valid in the clone.
+        base = pathlib.Path('clonebase.pdf')
+        copy = pathlib.Path('clonecopy.pdf')
+        with capypdf.Generator(base) as g:
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            g2 = g.clone(copy)
+            with g2.page_draw_context() as ctx:
+                ctx.render_text('Cloned document.', fid, 12, 50, 150)
+            g2.write()
+            with g.page_draw_context() as ctx:
+                ctx.render_text('Original document.', fid, 12, 50, 150)
+        self.assertTrue(b'NotoSans' in base.read_bytes())
+        self.assertTrue(b'NotoSans' in copy.read_bytes())
+        base.unlink()
+        copy.unlink()
+
+    def test_embedded_file_compression(self):
+        # Compressible attachments are deflated on their way to the
+        # output instead of being stored verbatim.
+        attachment = pathlib.Path('attachment.txt')
+        attachment.write_text('A very compressible line of text.\n' * 1000)
+        ofile = pathlib.Path('embeddedcomp.pdf')
+        with capypdf.Generator(ofile) as g:
+            embid = g.embed_file(attachment)
+            emba = capypdf.Annotation.new_file_attachment_annotation(embid)
+            emba.set_rectangle(30, 50, 40, 60)
+            aid = g.create_annotation(emba)
+            with g.page_draw_context() as ctx:
+                ctx.annotate(aid)
+        contents = ofile.read_bytes()
+        self.assertTrue(b'/EmbeddedFile' in contents)
+        self.assertTrue(b'/FlateDecode' in contents)
+        self.assertFalse(b'A very compressible line' in contents)
+        self.assertTrue(len(contents) < attachment.stat().st_size)
+        attachment.unlink()
+        ofile.unlink()
+
+    def test_shaped_run(self):
+        ofile = pathlib.Path('shapedrun.pdf')
+        with capypdf.Generator(ofile) as g:
+            font = g.load_font(noto_fontdir / 'NotoSerif-Regular.ttf')
+            with g.page_draw_context() as ctx:
+                t = ctx.text_new()
+                t.cmd_Tf(font, 12)
+                t.cmd_Td(10, 100)
+                ts = capypdf.TextSequence()
+                ts.append_shaped_run([36, 37, 38],
+                                     ['A', 'B', 'C'],
+                                     [0, 120, 0])
+                ts.append_shaped_run([39, 40], ['D', 'E'])
+                with self.assertRaises(capypdf.CapyPDFException):
+                    ts.append_shaped_run([41], ['F', 'G'])
+                t.cmd_TJ(ts)
+                ctx.render_text_obj(t)
+        ofile.unlink()
+
+    def test_async_write(self):
+        ofile = pathlib.Path('asyncwrite.pdf')
+        g = capypdf.Generator(ofile)
+        with g.page_draw_context() as ctx:
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_f()
+        g.write_async()
+        g.wait()
+        self.assertTrue(ofile.exists())
+        with self.assertRaises(capypdf.CapyPDFException):
+            g.wait()
+        ofile.unlink()
+
+    def test_object_streams(self):
+        ofile = pathlib.Path('objstm.pdf')
+        opts = capypdf.Options()
+        opts.set_object_streams(True)
+        with capypdf.Generator(ofile, opts) as g:
+            for i in range(10):
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_re(10, 10, 100, 100)
+                    ctx.cmd_f()
+        contents = ofile.read_bytes()
+        self.assertTrue(b'/ObjStm' in contents)
+        self.assertTrue(b'/XRef' in contents)
+        self.assertFalse(b'trailer' in contents)
+        ofile.unlink()
+
+    def test_resource_deduplication(self):
+        ofile = pathlib.Path('dedup.pdf')
+        with capypdf.Generator(ofile) as g:
+            jpg1 = g.embed_jpg(image_dir / 'simple.jpg')
+            jpg2 = g.embed_jpg(image_dir / 'simple.jpg')
+            gstate = capypdf.GraphicsState()
+            gstate.set_ca(0.5)
+            gsid1 = g.add_graphics_state(gstate)
+            gsid2 = g.add_graphics_state(gstate)
+            for i in range(2):
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_gs(gsid1 if i == 0 else gsid2)
+                    ctx.draw_image(jpg1 if i == 0 else jpg2)
+        contents = ofile.read_bytes()
+        self.assertEqual(contents.count(b'/DCTDecode'), 1)
+        self.assertEqual(contents.count(b'/ExtGState'), 1)
+        ofile.unlink()
+
+    def test_coordinate_precision(self):
+        ofile = pathlib.Path('coordprec.pdf')
+        opts = capypdf.Options()
+        opts.set_coordinate_precision(2)
+        with capypdf.Generator(ofile, opts) as g:
+            with g.page_draw_context() as ctx:
+                ctx.cmd_re(10, 10.128, 100, 100)
+                ctx.cmd_f()
+        contents = ofile.read_bytes()
+        self.assertTrue(b'10 10.13 100 100 re' in contents)
+        ofile.unlink()
+        with self.assertRaises(capypdf.CapyPDFException):
+            opts.set_coordinate_precision(-1)
+        with self.assertRaises(capypdf.CapyPDFException):
+            opts.set_coordinate_precision(18)
+
+    def test_balanced_page_tree(self):
+        ofile = pathlib.Path('pagetree.pdf')
+        with capypdf.Generator(ofile) as g:
+            for i in range(70):
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_re(10, 10, 100, 100)
+                    ctx.cmd_f()
+        contents = ofile.read_bytes()
+        # 70 pages with a fanout of 32 produce three intermediate
+        # nodes under the root.
+        self.assertEqual(contents.count(b'/Type /Pages'), 4)
+        self.assertEqual(contents.count(b'/Count 70'), 1)
+        ofile.unlink()
+
+    def test_incremental_update(self):
+        ofile = pathlib.Path('incremental.pdf')
+        with capypdf.Generator(ofile) as g:
+            with g.page_draw_context() as ctx:
+                ctx.cmd_re(10, 10, 100, 100)
+                ctx.cmd_f()
+        base_contents = ofile.read_bytes()
+        updated = pathlib.Path('incremental_v2.pdf')
+        opts = capypdf.Options()
+        opts.set_incremental_base(ofile)
+        with capypdf.Generator(updated, opts) as g:
+            with g.page_draw_context() as ctx:
+                ctx.cmd_re(20, 20, 50, 50)
+                ctx.cmd_f()
+        contents = updated.read_bytes()
+        # The update starts with the base file verbatim.
+        self.assertTrue(contents.startswith(base_contents))
+        self.assertGreater(len(contents), len(base_contents))
+        self.assertEqual(contents.count(b'%%EOF'), 2)
+        self.assertTrue(b'/Prev' in contents)
+        self.assertEqual(contents.count(b'/Count 2'), 1)
+        ofile.unlink()
+        updated.unlink()
+
+    def test_shard_merge(self):
+        shard_files = []
+        for i in range(3):
+            ofile = pathlib.Path(f'shard{i}.pdf')
+            shard_files.append(ofile)
+            opts = capypdf.Options()
+            opts.set_shard_object_offset(100 * i)
+            with capypdf.Generator(ofile, opts) as g:
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_re(10 * (i + 1), 10, 100, 100)
+                    ctx.cmd_f()
+        merged = pathlib.Path('merged.pdf')
+        capypdf.merge_shards(shard_files, merged)
+        contents = merged.read_bytes()
+        # Every shard's bytes appear in the output verbatim.
+        self.assertTrue(contents.startswith(shard_files[0].read_bytes()))
+        for shard in shard_files[1:]:
+            self.assertTrue(shard.read_bytes() in contents)
+        # A new root node lists all three pages, each shard root has one.
+        self.assertEqual(contents.count(b'/Count 3'), 1)
+        offset = int(contents[contents.rfind(b'startxref'):].split(b'\n')[1])
+        self.assertTrue(contents[offset:].startswith(b'xref'))
+        # Shards with overlapping object numbers can not be merged.
+        with self.assertRaises(capypdf.CapyPDFException):
+            capypdf.merge_shards([shard_files[0], shard_files[0]], merged)
+        for shard in shard_files:
+            shard.unlink()
+        merged.unlink()
+
+    def test_write_to_bytes(self):
+        g = capypdf.Generator('unused.pdf')
+        with g.page_draw_context() as ctx:
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_f()
+        contents = g.write_to_bytes()
+        del g
+        self.assertFalse(pathlib.Path('unused.pdf').exists())
+        self.assertTrue(contents.startswith(b'%PDF-'))
+        self.assertTrue(contents.endswith(b'%%EOF\n'))
+        # The startxref offset must point at the xref table even though
+        # the bytes never went through a file.
+        offset = int(contents[contents.rfind(b'startxref'):].split(b'\n')[1])
+        self.assertTrue(contents[offset:].startswith(b'xref'))
+
+    def test_generation_stats(self):
+        ofile = pathlib.Path('stats.pdf')
+        g = capypdf.Generator(ofile)
+        with g.page_draw_context() as ctx:
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_f()
+        g.write()
+        self.assertGreater(g.get_stat(capypdf.Stat.ObjectsWritten), 0)
+        self.assertEqual(g.get_stat(capypdf.Stat.BytesWritten), ofile.stat().st_size)
+        self.assertGreaterEqual(g.get_stat(capypdf.Stat.WriteSeconds), 0)
+        del g
+        ofile.unlink()
+
+    def test_compression_policy(self):
+        import random
+        ofile = pathlib.Path('compressionpolicy.pdf')
+        opts = capypdf.Options()
+        opts.set_compression_level(capypdf.StreamClass.Content, 1)
+        opts.set_compression_level(capypdf.StreamClass.Image, 1)
+        random.seed(42)
+        noise = bytes(random.randrange(256) for _ in range(64*64*3))
+        with capypdf.Generator(ofile, opts) as g:
+            ib = capypdf.RasterImageBuilder()
+            ib.set_size(64, 64)
+            ib.set_pixel_data(noise)
+            iid = g.add_image(ib.build(), capypdf.ImagePdfProperties())
+            with g.page_draw_context() as ctx:
+                with ctx.push_gstate():
+                    ctx.scale(100, 100)
+                    ctx.draw_image(iid)
+        contents = ofile.read_bytes()
+        # Incompressible pixel data is stored as is without a filter.
+        self.assertTrue(noise in contents)
+        ofile.unlink()
+
+    def test_png_passthrough(self):
+        ofile = pathlib.Path('pngpassthrough.pdf')
+        with capypdf.Generator(ofile) as g:
+            rgb = g.embed_png(image_dir / 'comic-colors.png')
+            # Has an alpha channel, so it goes through the decoding path.
+            rgba = g.embed_png(image_dir / 'capylogo_web.png')
+            with g.page_draw_context() as ctx:
+                for iid in (rgb, rgba):
+                    with ctx.push_gstate():
+                        ctx.translate(10, 10)
+                        ctx.scale(100, 100)
+                        ctx.draw_image(iid)
+        contents = ofile.read_bytes()
+        idat = extract_idat(image_dir / 'comic-colors.png')
+        # The compressed PNG bytes are copied to the output as is.
+        self.assertTrue(idat in contents)
+        self.assertEqual(contents.count(b'/Predictor 15'), 1)
+        self.assertTrue(b'/SMask' in contents)
+        ofile.unlink()
+
+    def test_form_xobject_template(self):
+        ofile = pathlib.Path('template.pdf')
+        with capypdf.Generator(ofile) as g:
+            tctx = capypdf.FormXObjectDrawContext(g, 200, 40)
+            tctx.cmd_re(10, 10, 180, 20)
+            tctx.cmd_S()
+            template = g.add_form_xobject(tctx)
+            del tctx
+            for i in range(3):
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_Do(template)
+        contents = ofile.read_bytes()
+        # The template stream is stored compressed and only once.
+        self.assertEqual(contents.count(b'/Subtype /Form'), 1)
+        self.assertTrue(b'10 10 180 20 re' not in contents)
+        ofile.unlink()
+
+    def test_cid_font(self):
+        ofile = pathlib.Path('cidfont.pdf')
+        with capypdf.Generator(ofile) as g:
+            font = g.load_cid_font(noto_fontdir / 'NotoSerif-Regular.ttf')
+            with g.page_draw_context() as ctx:
+                ctx.render_text('A single subset holds the whole text.', font, 12, 20, 640)
+        contents = ofile.read_bytes()
+        self.assertTrue(b'/Type0' in contents)
+        self.assertTrue(b'/Identity-H' in contents)
+        self.assertTrue(b'/CIDFontType2' in contents)
+        ofile.unlink()
+
     @validate_image('python_image', 200, 200)
     def test_images(self, ofilename, w, h):
         opts = capypdf.Options()